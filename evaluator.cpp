@@ -0,0 +1,213 @@
+/*
+ * evaluator.cpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#include <chrono>
+#include <ctime>
+#include <cmath>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <memory>
+#include <thread>
+#include <algorithm>
+#include <unordered_map>
+
+#include "backoff.hpp"
+#include "kneserNey.hpp"
+
+using std::vector;
+using std::string;
+using std::unique_ptr;
+using std::cout;
+using std::endl;
+using smoothPwd::ull;
+
+// guess-number curve without generating any guesses: every test password is scored with pwd_prob,
+// and mapped to its (estimated) guess number by a Monte Carlo rank table (see PosEstimator).
+int main(int argc, char *argv[]) {
+	// example: ./evaluator ../data/phpbb_train.txt ../data/phpbb_test.txt ../curve.txt kneserney 8 --samples 1000000
+	std::ios::sync_with_stdio(false);
+	if (argc < 6) {
+		cout << "too few arguments!" << endl;
+		cout << "Expected: evaluator train_path test_path output_path model_name model_arg [--samples n] [--seed s] [--threads k] [--count trie|sorted] [--train-mem MiB] [--tmp-dir dir] [--layout bfs|hot|blocked] [--huge-pages thp|explicit] [--numa] [--stats] [--trace file.json]" << endl;
+		return -1;
+	}
+	string train_path(argv[1]);
+	string test_path(argv[2]);
+	string output_path(argv[3]);
+	string model_name(argv[4]); // "kneserney" or "backoff"
+	int model_arg = atoi(argv[5]);
+
+	size_t num_samples = 1000000;
+	size_t num_threads = std::max(1u, std::thread::hardware_concurrency());
+	ull seed = 1; // of the Monte Carlo samples, fixed so every run gives the same curve (--seed for another draw)
+	size_t train_mem = 0; // > 0: count n-grams on disk (in tmp_dir) within this many bytes
+	string tmp_dir(".");
+	smoothPwd::CountMethod counting = smoothPwd::COUNT_TRIE; // how training counts n-grams: "trie" or "sorted" (suffix sorting)
+	string layout; // node renumbering after training: "bfs", "hot" or "blocked"
+	smoothPwd::PageMode pages = smoothPwd::PAGES_DEFAULT;
+	bool numa = false; // a model replica per NUMA node, scoring threads spread over the nodes
+	bool print_stats = false;
+	string trace_path; // Chrome trace of training (chrome://tracing, Perfetto)
+	for (int i = 6; i < argc; i++) {
+		string opt(argv[i]);
+		if (opt == "--samples" && i + 1 < argc) {
+			num_samples = (size_t)atoll(argv[++i]);
+		}
+		else if (opt == "--seed" && i + 1 < argc) {
+			seed = (ull)atoll(argv[++i]);
+		}
+		else if (opt == "--threads" && i + 1 < argc) {
+			num_threads = std::max(1, atoi(argv[++i]));
+		}
+		else if (opt == "--train-mem" && i + 1 < argc) {
+			train_mem = (size_t)atoll(argv[++i]) << 20;
+		}
+		else if (opt == "--tmp-dir" && i + 1 < argc) {
+			tmp_dir = argv[++i];
+		}
+		else if (opt == "--count" && i + 1 < argc) {
+			counting = string(argv[++i]) == "sorted" ? smoothPwd::COUNT_SORTED : smoothPwd::COUNT_TRIE;
+		}
+		else if (opt == "--layout" && i + 1 < argc) {
+			layout = argv[++i];
+		}
+		else if (opt == "--huge-pages" && i + 1 < argc) {
+			string kind(argv[++i]);
+			pages = kind == "explicit" ? smoothPwd::PAGES_EXPLICIT : smoothPwd::PAGES_TRANSPARENT;
+		}
+		else if (opt == "--numa") {
+			numa = true;
+		}
+		else if (opt == "--stats") {
+			print_stats = true;
+		}
+		else if (opt == "--trace" && i + 1 < argc) {
+			trace_path = argv[++i];
+		}
+		else {
+			cout << "unknown option: " << opt << endl;
+			return -1;
+		}
+	}
+
+	unique_ptr<smoothPwd::BaseTrieModel> model;
+	if (model_name == "backoff") {
+		model = unique_ptr<smoothPwd::BaseTrieModel>(new smoothPwd::KatzBackoffModel(model_arg));
+		cout << "Katz backoff model, threshold: " << model_arg << endl;
+	}
+	else { // kneserney by default
+		model = unique_ptr<smoothPwd::BaseTrieModel>(new smoothPwd::ModifiedKneserNeyModel(model_arg));
+		cout << "Modified Kneser-Ney model, gram size: " << model_arg << endl;
+	}
+
+	model->collect_stats(print_stats);
+	if (!trace_path.empty()) smoothPwd::Tracer::global().enable();
+	if (train_mem > 0) { // out-of-core: the corpus is never held in memory, counts are spilled to tmp_dir
+		clock_t tr_clock = clock();
+		smoothPwd::ExternalNgramCounter counter(tmp_dir, train_mem, model->gram_size);
+		std::ifstream ftr(train_path);
+		string line;
+		while (std::getline(ftr, line)) {
+			counter.add(line.c_str());
+		}
+		model->train(counter);
+		cout << "training size: " << counter.size() << " runs: " << counter.num_runs()
+			<< " time: " << (double)(clock() - tr_clock) / CLOCKS_PER_SEC << endl;
+	}
+	else {
+		vector<string> train_data;
+		std::ifstream ftr(train_path);
+		string line;
+		while (std::getline(ftr, line)) {
+			train_data.push_back(line);
+		}
+		clock_t tr_clock = clock();
+		model->train(train_data, counting);
+		cout << "training size: " << train_data.size()
+			<< " time: " << (double)(clock() - tr_clock) / CLOCKS_PER_SEC << endl;
+	}
+	if (layout == "bfs") model->renumber(smoothPwd::BaseTrieModel::LAYOUT_BFS);
+	else if (layout == "hot") model->renumber(smoothPwd::BaseTrieModel::LAYOUT_HOT);
+	else if (layout == "blocked") model->renumber(smoothPwd::BaseTrieModel::LAYOUT_BLOCKED);
+	if (pages != smoothPwd::PAGES_DEFAULT) model->use_huge_pages(pages);
+	size_t num_nodes = numa ? model->replicate_numa() : 1;
+	vector<int> replica_nodes = model->replica_nodes(); // node ids need not be 0, 1, ...
+	if (numa) cout << "NUMA nodes: " << num_nodes << endl;
+	if (print_stats) model->stats().print(cout);
+	if (!trace_path.empty()) {
+		smoothPwd::Tracer::global().summary(cout);
+		if (!smoothPwd::Tracer::global().write_chrome(trace_path)) cout << "cannot write " << trace_path << endl;
+	}
+
+	// rank table
+	auto mc_start = std::chrono::steady_clock::now();
+	vector<smoothPwd::StrProb> samples = model->sample_many(num_samples, seed, num_threads);
+	smoothPwd::PosEstimator estimator(samples);
+	vector<smoothPwd::StrProb>().swap(samples);
+	cout << "sampled " << num_samples << " passwords (seed " << seed << "), time: "
+		<< std::chrono::duration<double>(std::chrono::steady_clock::now() - mc_start).count() << endl;
+
+	// test set, deduplicated
+	vector<string> pwds;
+	vector<ull> cnts;
+	ull test_size = 0;
+	{
+		std::unordered_map<string, ull> counter;
+		std::ifstream fts(test_path);
+		string line;
+		while (std::getline(fts, line)) {
+			counter[line]++;
+			++test_size;
+		}
+		for (const auto &item : counter) {
+			pwds.push_back(item.first);
+			cnts.push_back(item.second);
+		}
+	}
+
+	// score in parallel; the model is only read
+	vector<double> guess_nums(pwds.size());
+	{
+		const smoothPwd::BaseTrieModel &m = *model;
+		vector<std::thread> workers;
+		for (size_t t = 0; t < num_threads; t++) {
+			workers.emplace_back([&, t]() {
+				if (!replica_nodes.empty()) smoothPwd::numa_bind_thread(replica_nodes[t % replica_nodes.size()]);
+				// a contiguous slice per thread, scored in lockstep batches
+				size_t first = pwds.size() * t / num_threads, last = pwds.size() * (t + 1) / num_threads;
+				vector<const char *> slice;
+				for (size_t i = first; i < last; i++) slice.push_back(pwds[i].c_str());
+				vector<double> probs(slice.size());
+				m.pwd_prob_batch(slice.data(), slice.size(), probs.data());
+				for (size_t i = first; i < last; i++) {
+					double p = probs[i - first];
+					guess_nums[i] = p > 0.0 ? estimator.position(p) : INFINITY; // 0 prob.: never guessed
+				}
+			});
+		}
+		for (auto &w : workers) w.join();
+	}
+
+	// curve: cracked fraction at log-spaced guess numbers (10 points per decade)
+	vector<std::pair<double, ull> > ranked;
+	for (size_t i = 0; i < pwds.size(); i++) ranked.emplace_back(guess_nums[i], cnts[i]);
+	sort(ranked.begin(), ranked.end());
+
+	std::ofstream fout(output_path);
+	ull cracked = 0;
+	size_t pos = 0;
+	double last_guess = 1.0;
+	for (int k = 0; k <= 200; k++) { // up to 10^20 guesses
+		double guesses = pow(10.0, k / 10.0);
+		while (pos < ranked.size() && ranked[pos].first <= guesses) cracked += ranked[pos++].second;
+		fout << guesses << " " << (double)cracked / test_size << '\n';
+		last_guess = guesses;
+		if (pos == ranked.size()) break;
+	}
+	cout << "guesses: " << last_guess << " cracked: " << cracked << " test_size: " << test_size
+		<< " fraction: " << (double)cracked / test_size << endl;
+	return 0;
+}
@@ -16,6 +16,7 @@
 
 #include "kneserNey.hpp"
 #include "backoff.hpp"
+#include "scoringSession.hpp"
 
 using std::ifstream;
 using std::ofstream;
@@ -78,6 +79,12 @@ int main() {
 	cout << model.pwd_prob("password") << endl;
 	cout << model.pwd_prob("password123456") << endl;
 	cout << model.pwd_prob("loopy-song@github.io") << endl;
+	{ // scored as typed: one model step per keystroke
+		ScoringSession typing(model);
+		for (const char *c = "password1"; *c; c++) typing.push(*c);
+		typing.pop(); // backspace
+		cout << typing.prob() << endl; // = pwd_prob("password")
+	}
 
 	// sampling example
 	vector<std::pair<string, double> > samples;
@@ -4,65 +4,457 @@
  */
 
 #include <ctime>
+#include <cstdio>
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <memory>
+#include <thread>
+#include <algorithm>
+
+#include <unistd.h>
 
 #include "backoff.hpp"
 #include "kneserNey.hpp"
+#include "guessWriter.hpp"
+#include "mergedStream.hpp"
+#include "checkpoint.hpp"
+#include "rankIndex.hpp"
 
 using std::vector;
 using std::string;
 using std::unique_ptr;
 using std::cout;
 using std::endl;
+using smoothPwd::ull;
 
 int main(int argc, char *argv[]) {
 	// example: ./guesser ../data/phpbb_train.txt ../result.txt  10000000 kneserney 8
+	// sharded:  ./guesser ../data/phpbb_train.txt ../result_3.txt 10000000 kneserney 8 --shard 3 16
+	// out-of-core: ./guesser ../data/phpbb_train.txt ../result.txt 10000000000 kneserney 8 --mem-limit 4096 --tmp-dir /scratch
+	// big corpus: ./guesser ../data/all_leaks.txt ../result.txt 10000000 kneserney 8 --train-mem 8192 --tmp-dir /scratch
+	// after a dictionary stage: ./guesser ../data/phpbb_train.txt ../result.txt 10000000 kneserney 8 --exclude ../data/rockyou.txt
+	//                           (add --save-exclude ../data/rockyou.blm once, then pass --exclude ../data/rockyou.blm)
+	// two models: ./guesser ../data/phpbb_train.txt ../result.txt 10000000 kneserney 8 --merge ../data/rockyou_train.txt backoff 10 0.5
+	// preemptible: ./guesser ../data/phpbb_train.txt ../result.txt 10000000000 kneserney 8 --checkpoint ../result.ckpt
+	// membership: ./guesser ../data/phpbb_train.txt ../result.txt 10000000 kneserney 8 --rank-index ../result.rank
+	// for a ModelRegistry: ./guesser ../data/phpbb_train.txt ../result.txt 0 kneserney 8 --save-image ../phpbb_kn8.img
+	// piped:    ./guesser ../data/phpbb_train.txt - 10000000000 kneserney 8 --stream --threads 8 | hashcat ...
+	// exactly guess_num: ./guesser ../data/phpbb_train.txt ../result.txt 10000000 kneserney 8 --exact
+	// policy:   ./guesser ../data/phpbb_train.txt ../result.txt 10000000 kneserney 8 --min-len 8 --max-len 16 --require ds
 	std::ios::sync_with_stdio(false);
 	if (argc < 6) {
 		cout << "too few arguments!" << endl;
-		cout << "Expected: guesser train_path output_path guess_num model_name model_arg" << endl;
+		cout << "Expected: guesser train_path output_path guess_num model_name model_arg [--shard i n] "
+			"[--mem-limit MiB] [--tmp-dir dir] [--stream] [--threads k] [--binary] [--exact] "
+			"[--min-len l] [--max-len l] [--require lusd] [--prefix s] [--suffix s] [--renormalize] [--exclude wordlist] [--exclude-bits b] [--save-exclude file] [--merge train_path model_name model_arg weight]... [--weight w] [--checkpoint file] [--rank-index file] [--count trie|sorted] [--train-mem MiB] [--layout bfs|hot|blocked] [--huge-pages thp|explicit] [--stats] [--trace file.json] [--save-image file]" << endl;
 		return -1;
 	}
 	string train_path(argv[1]);
-	string output_path(argv[2]);
+	string output_path(argv[2]); // "-" is stdout
 	long long guess_num = atoll(argv[3]);
 	string model_name(argv[4]); // "kneserney" or "backoff"
 	int model_arg = atoi(argv[5]);
 
-	unique_ptr<smoothPwd::BaseTrieModel> model;
-	if (model_name == "backoff") {
-		model = unique_ptr<smoothPwd::BaseTrieModel>(new smoothPwd::KatzBackoffModel(model_arg));
-		cout << "Katz backoff model, threshold: " << model_arg << endl;
+	size_t shard = 0, num_shards = 1; // shard i of n: disjoint slices whose union is the full guess list
+	size_t mem_limit = 0;             // > 0: sort guesses on disk within this many bytes
+	string tmp_dir(".");
+	string exclude_path;              // wordlist (or saved GuessFilter) of guesses tried already: left out
+	double exclude_bits = 10.0;       // filter bits per wordlist entry (~1% false positives at 10)
+	string save_exclude_path;         // keep the filter built from the --exclude wordlist, to pass as --exclude next time
+	size_t train_mem = 0;             // > 0: count n-grams on disk (in tmp_dir) within this many bytes
+	bool stream = false;              // write guesses while searching (roughly ordered, in prob. bands)
+	size_t num_threads = 1;           // search threads in stream mode, sort threads otherwise
+	bool binary = false;              // [uint16 len][chars][double prob] records instead of lines
+	bool exact = false;               // search down to the exact threshold of guess_num guesses, not a bucket below it
+	int min_len = 0, max_len = smoothPwd::MAX_LENGTH, required = 0; // policy: only guesses it accepts
+	string prefix, suffix;
+	bool use_policy = false, renormalize = false;
+	smoothPwd::CountMethod counting = smoothPwd::COUNT_TRIE; // how training counts n-grams: "trie" or "sorted" (suffix sorting)
+	string layout;                    // node renumbering after training: "bfs", "hot" or "blocked"
+	smoothPwd::PageMode pages = smoothPwd::PAGES_DEFAULT;
+	bool print_stats = false;         // model sizes and per-phase training memory
+	string trace_path;                // Chrome trace of training (chrome://tracing, Perfetto)
+	struct MergedSpec { string train_path, model_name; int model_arg; double weight; };
+	vector<MergedSpec> merged;        // more models whose guesses are merged in by weighted prob., duplicates dropped
+	double weight = 1.0;              // of the main model in a merge
+	string checkpoint_path;           // generate in bands, saving progress after each; a rerun resumes from it
+	string rank_index_path;           // also compile the output into a GuessRankIndex (top-N membership)
+	string image_path;                // also save the trained model as an image (see ModelRegistry)
+	for (int i = 6; i < argc; i++) {
+		string opt(argv[i]);
+		if (opt == "--shard" && i + 2 < argc) {
+			shard = (size_t)atoll(argv[++i]);
+			num_shards = (size_t)atoll(argv[++i]);
+		}
+		else if (opt == "--mem-limit" && i + 1 < argc) {
+			mem_limit = (size_t)atoll(argv[++i]) << 20;
+		}
+		else if (opt == "--tmp-dir" && i + 1 < argc) {
+			tmp_dir = argv[++i];
+		}
+		else if (opt == "--stream") {
+			stream = true;
+		}
+		else if (opt == "--threads" && i + 1 < argc) {
+			num_threads = std::max(1, atoi(argv[++i]));
+		}
+		else if (opt == "--binary") {
+			binary = true;
+		}
+		else if (opt == "--exact") {
+			exact = true;
+		}
+		else if (opt == "--min-len" && i + 1 < argc) {
+			min_len = atoi(argv[++i]);
+			use_policy = true;
+		}
+		else if (opt == "--max-len" && i + 1 < argc) {
+			max_len = atoi(argv[++i]);
+			use_policy = true;
+		}
+		else if (opt == "--require" && i + 1 < argc) { // l: lower, u: upper, d: digit, s: symbol
+			for (const char *c = argv[++i]; *c; c++) {
+				if (*c == 'l') required |= smoothPwd::PasswordPolicy::LOWER;
+				else if (*c == 'u') required |= smoothPwd::PasswordPolicy::UPPER;
+				else if (*c == 'd') required |= smoothPwd::PasswordPolicy::DIGIT;
+				else if (*c == 's') required |= smoothPwd::PasswordPolicy::SYMBOL;
+			}
+			use_policy = true;
+		}
+		else if (opt == "--prefix" && i + 1 < argc) {
+			prefix = argv[++i];
+			use_policy = true;
+		}
+		else if (opt == "--suffix" && i + 1 < argc) {
+			suffix = argv[++i];
+			use_policy = true;
+		}
+		else if (opt == "--renormalize") {
+			renormalize = true;
+		}
+		else if (opt == "--exclude" && i + 1 < argc) {
+			exclude_path = argv[++i];
+		}
+		else if (opt == "--exclude-bits" && i + 1 < argc) {
+			exclude_bits = atof(argv[++i]);
+		}
+		else if (opt == "--save-exclude" && i + 1 < argc) {
+			save_exclude_path = argv[++i];
+		}
+		else if (opt == "--train-mem" && i + 1 < argc) {
+			train_mem = (size_t)atoll(argv[++i]) << 20;
+		}
+		else if (opt == "--count" && i + 1 < argc) {
+			counting = string(argv[++i]) == "sorted" ? smoothPwd::COUNT_SORTED : smoothPwd::COUNT_TRIE;
+		}
+		else if (opt == "--layout" && i + 1 < argc) {
+			layout = argv[++i];
+		}
+		else if (opt == "--stats") {
+			print_stats = true;
+		}
+		else if (opt == "--trace" && i + 1 < argc) {
+			trace_path = argv[++i];
+		}
+		else if (opt == "--merge" && i + 4 < argc) {
+			MergedSpec spec;
+			spec.train_path = argv[++i];
+			spec.model_name = argv[++i];
+			spec.model_arg = atoi(argv[++i]);
+			spec.weight = atof(argv[++i]);
+			merged.push_back(spec);
+		}
+		else if (opt == "--checkpoint" && i + 1 < argc) {
+			checkpoint_path = argv[++i];
+		}
+		else if (opt == "--save-image" && i + 1 < argc) {
+			image_path = argv[++i];
+		}
+		else if (opt == "--rank-index" && i + 1 < argc) {
+			rank_index_path = argv[++i];
+		}
+		else if (opt == "--weight" && i + 1 < argc) {
+			weight = atof(argv[++i]);
+		}
+		else if (opt == "--huge-pages" && i + 1 < argc) {
+			string kind(argv[++i]);
+			pages = kind == "explicit" ? smoothPwd::PAGES_EXPLICIT : smoothPwd::PAGES_TRANSPARENT;
+		}
+		else {
+			cout << "unknown option: " << opt << endl;
+			return -1;
+		}
 	}
-	else { // kneserney by default
-		model = unique_ptr<smoothPwd::BaseTrieModel>(new smoothPwd::ModifiedKneserNeyModel(model_arg));
-		cout << "Modified Kneser-Ney model, gram size: " << model_arg << endl;
+	if (num_shards == 0 || shard >= num_shards) {
+		cout << "invalid shard: " << shard << " of " << num_shards << endl;
+		return -1;
 	}
 
-	{
+	if (!merged.empty() && (!checkpoint_path.empty() || num_shards > 1 || stream || mem_limit > 0 || !rank_index_path.empty() || use_policy)) {
+		cout << "--merge takes no --checkpoint, --shard, --stream, --mem-limit, --rank-index or policy" << endl;
+		return -1;
+	}
+	if (use_policy && (num_shards > 1 || stream || mem_limit > 0)) {
+		cout << "a policy takes no --shard, --stream or --mem-limit" << endl;
+		return -1;
+	}
+	if (exact && (!exclude_path.empty() || !merged.empty() || use_policy)) { // those stop at guess_num (new) guesses already
+		cout << "--exact takes no --exclude, --merge or policy" << endl;
+		return -1;
+	}
+	if (!save_exclude_path.empty() && exclude_path.empty()) {
+		cout << "--save-exclude needs --exclude" << endl;
+		return -1;
+	}
+	if (renormalize && !use_policy) {
+		cout << "--renormalize needs a policy (--min-len, --max-len, --require, --prefix or --suffix)" << endl;
+		return -1;
+	}
+	if (!checkpoint_path.empty() && (use_policy || stream || mem_limit > 0)) {
+		cout << "--checkpoint takes no policy, --stream or --mem-limit" << endl;
+		return -1;
+	}
+	if (!rank_index_path.empty() && (stream || num_shards > 1)) { // ranks are positions in the full, ordered guess list
+		cout << "--rank-index takes no --stream or --shard" << endl;
+		return -1;
+	}
+	if ((!checkpoint_path.empty() || !rank_index_path.empty()) && output_path == "-") {
+		cout << "--checkpoint and --rank-index need an output file" << endl;
+		return -1;
+	}
+	// a checkpointed job may be resuming: its output is cut back to the checkpoint, not emptied, on open
+	FILE *out = output_path == "-" ? stdout : fopen(output_path.c_str(), checkpoint_path.empty() ? "wb" : "ab");
+	if (out == nullptr) {
+		cout << "cannot open " << output_path << endl;
+		return -1;
+	}
+	std::ostream &log = out == stdout ? std::cerr : cout; // keep stdout clean for the guesses
+
+	auto make_model = [&log](const string &name, int arg) {
+		if (name == "backoff") {
+			log << "Katz backoff model, threshold: " << arg << endl;
+			return unique_ptr<smoothPwd::BaseTrieModel>(new smoothPwd::KatzBackoffModel(arg));
+		}
+		// kneserney by default
+		log << "Modified Kneser-Ney model, gram size: " << arg << endl;
+		return unique_ptr<smoothPwd::BaseTrieModel>(new smoothPwd::ModifiedKneserNeyModel(arg));
+	};
+	auto train_in_memory = [&log, counting](smoothPwd::BaseTrieModel &m, const string &path) {
 		vector<string> train_data;
-		std::ifstream ftr(train_path);
+		std::ifstream ftr(path);
 		string line;
 		while (std::getline(ftr, line)) {
 			train_data.push_back(line);
 		}
 		clock_t tr_clock = clock();
-		model->train(train_data);
-		cout << "training size: " << train_data.size()
+		m.train(train_data, counting);
+		log << "training size: " << train_data.size()
+			<< " time: " << (double)(clock() - tr_clock) / CLOCKS_PER_SEC << endl;
+	};
+
+	unique_ptr<smoothPwd::BaseTrieModel> model = make_model(model_name, model_arg);
+	model->collect_stats(print_stats);
+
+	if (!trace_path.empty()) smoothPwd::Tracer::global().enable();
+	if (train_mem > 0) { // out-of-core: the corpus is never held in memory, counts are spilled to tmp_dir
+		clock_t tr_clock = clock();
+		smoothPwd::ExternalNgramCounter counter(tmp_dir, train_mem, model->gram_size);
+		std::ifstream ftr(train_path);
+		string line;
+		while (std::getline(ftr, line)) {
+			counter.add(line.c_str());
+		}
+		model->train(counter);
+		log << "training size: " << counter.size() << " runs: " << counter.num_runs()
 			<< " time: " << (double)(clock() - tr_clock) / CLOCKS_PER_SEC << endl;
 	}
+	else {
+		train_in_memory(*model, train_path);
+	}
+	if (layout == "bfs") model->renumber(smoothPwd::BaseTrieModel::LAYOUT_BFS);
+	else if (layout == "hot") model->renumber(smoothPwd::BaseTrieModel::LAYOUT_HOT);
+	else if (layout == "blocked") model->renumber(smoothPwd::BaseTrieModel::LAYOUT_BLOCKED);
+	if (pages != smoothPwd::PAGES_DEFAULT) model->use_huge_pages(pages);
+	if (print_stats) model->stats().print(log);
+	if (!image_path.empty()) {
+		try {
+			model->save_image(image_path);
+		}
+		catch (const std::runtime_error &e) {
+			log << e.what() << endl;
+			return -1;
+		}
+	}
+	if (!trace_path.empty()) {
+		smoothPwd::Tracer::global().summary(log);
+		if (!smoothPwd::Tracer::global().write_chrome(trace_path)) log << "cannot write " << trace_path << endl;
+	}
+
+	unique_ptr<smoothPwd::GuessFilter> filter;
+	if (!exclude_path.empty()) {
+		try {
+			if (smoothPwd::GuessFilter::is_saved(exclude_path)) filter.reset(new smoothPwd::GuessFilter(smoothPwd::GuessFilter::load(exclude_path)));
+			else filter.reset(new smoothPwd::GuessFilter(smoothPwd::GuessFilter::from_wordlist(exclude_path, exclude_bits)));
+			if (!save_exclude_path.empty()) filter->save(save_exclude_path);
+		}
+		catch (const std::runtime_error &e) { // a damaged filter is an error, not a wordlist
+			log << e.what() << endl;
+			return -1;
+		}
+		log << "excluding " << filter->size() << " guesses, filter: " << filter->bytes() / 1048576.0 << " MiB" << endl;
+	}
+	// in the streaming, out-of-core and sharded modes the filter is applied at the threshold it implies
+	auto threshold = [&]() { return filter ? model->exclusion_threshold(*filter, guess_num) : model->strict_threshold(guess_num, exact); };
+	auto is_new = [&filter](const string &s) { return !filter || !filter->contains(s); };
 
 	clock_t ts_clock = clock();
-	auto guesses = model->generate(guess_num, false);
-	cout << "generated " << guesses.size() << " guesses, time: "
-		<< (double)(clock() - ts_clock) / CLOCKS_PER_SEC << endl;
+	smoothPwd::GuessWriter writer(out, binary ? smoothPwd::GuessWriter::BINARY : smoothPwd::GuessWriter::TEXT);
+
+	if (!merged.empty()) { // models run side by side, their guess streams merged by weighted prob. (other modes are refused above)
+		vector<unique_ptr<smoothPwd::BaseTrieModel> > others;
+		vector<const smoothPwd::BaseTrieModel *> models(1, model.get());
+		vector<double> weights(1, weight);
+		for (const auto &spec : merged) {
+			others.push_back(make_model(spec.model_name, spec.model_arg));
+			train_in_memory(*others.back(), spec.train_path);
+			models.push_back(others.back().get());
+			weights.push_back(spec.weight);
+		}
+		ts_clock = clock();
+		smoothPwd::MergedGuessStream merger(models, weights);
+		auto emit = writer.producer();
+		string s;
+		double p;
+		for (long long n = 0; n < guess_num && merger.next(s, p);) {
+			if (is_new(s)) {
+				emit(s, p);
+				++n;
+			}
+		}
+	}
+	else if (!checkpoint_path.empty()) { // each band is on disk, and recorded in the checkpoint, before the next is searched
+		smoothPwd::GenerationCheckpoint job, saved;
+		job.guess_num = (ull)guess_num;
+		job.thres = threshold();
+		job.format = binary ? smoothPwd::GuessWriter::BINARY : smoothPwd::GuessWriter::TEXT;
+		job.shard = shard;
+		job.num_shards = num_shards;
+		job.model = model->fingerprint();
+		job.filter = filter ? filter->fingerprint() : 0;
+		try {
+			if (smoothPwd::GenerationCheckpoint::load(checkpoint_path, saved) && saved.same_job(job)) {
+				job = saved;
+				log << "resuming after " << job.emitted << " guesses" << endl;
+			}
+			if (ftruncate(fileno(out), (off_t)job.offset) != 0)
+				throw std::runtime_error("cannot truncate " + output_path);
+			ull emitted = job.emitted;
+			model->generate_bands([&](const vector<smoothPwd::StrProb> &guesses, double lo) {
+				{
+					auto emit = writer.producer();
+					for (const auto& n : guesses) {
+						if (is_new(n.first)) emit(n.first, n.second);
+					}
+				}
+				if (!writer.sync() || fsync(fileno(out)) != 0)
+					throw std::runtime_error("cannot write " + output_path);
+				job.hi = lo;
+				job.emitted = emitted + writer.count();
+				job.offset = (ull)ftello(out);
+				job.save(checkpoint_path);
+			}, job.thres, job.hi, job.factor, (size_t)1 << 20, shard, num_shards);
+		}
+		catch (const std::runtime_error &e) {
+			log << e.what() << endl;
+			return -1;
+		}
+	}
+	else if (use_policy) { // constrained search (shards, streaming and spilling are refused with it above)
+		smoothPwd::PasswordPolicy policy(min_len, max_len, required, prefix, suffix);
+		vector<smoothPwd::StrProb> guesses;
+		for (ull n = (ull)guess_num;;) { // with --exclude, ask for more until guess_num of them are new
+			guesses = model->generate_by_policy(policy, n, renormalize);
+			ull fresh = (ull)std::count_if(guesses.begin(), guesses.end(), [&is_new](const smoothPwd::StrProb &g) { return is_new(g.first); });
+			if (fresh >= (ull)guess_num || guesses.size() < n) break; // enough, or the policy accepts no more
+			n += (ull)guess_num - fresh;
+		}
+		auto emit = writer.producer();
+		for (const auto& n : guesses) {
+			if (is_new(n.first)) emit(n.first, n.second);
+		}
+	}
+	else if (stream) { // search threads feed the writer directly; bands of decreasing prob. keep the order rough-sorted
+		double thres = threshold();
+		auto parts = model->split_shard(shard, num_shards, num_threads, thres); // the same shard as without --stream
+		vector<std::thread> workers;
+		for (size_t j = 0; j < num_threads; j++) {
+			const auto &frames = parts[j];
+			const smoothPwd::BaseTrieModel &m = *model;
+			workers.emplace_back([&writer, &frames, &m, &is_new, thres]() {
+				auto producer = writer.producer();
+				auto emit = [&producer, &is_new](const string &s, double p) { if (is_new(s)) producer(s, p); };
+				for (double hi = 1.0; hi > thres; hi /= 16) {
+					m.search_frames(emit, frames, std::max(thres, hi / 16), hi);
+				}
+			});
+		}
+		for (auto &t : workers) t.join();
+	}
+	else if (mem_limit > 0) { // out-of-core: spill sorted runs to tmp_dir, merge straight into the output
+		smoothPwd::ExternalGuessSorter sorter(tmp_dir, mem_limit);
+		auto add = [&sorter, &is_new](const string &s, double p) { if (is_new(s)) sorter.add(s, p); };
+		double thres = threshold();
+		if (num_shards > 1) model->threshold_search_shard(add, shard, num_shards, thres);
+		else model->threshold_search(add, thres);
+		log << "searched, " << sorter.num_runs() << " runs spilled, time: "
+			<< (double)(clock() - ts_clock) / CLOCKS_PER_SEC << endl;
 
-	std::ofstream fout(output_path);
-	for (const auto& n : guesses) {
-		fout << n.first << '\n';
+		auto emit = writer.producer();
+		sorter.merge(emit, exact ? (ull)guess_num : ULLONG_MAX);
+	}
+	else if (num_shards > 1) { // by the threshold all shards derive alike
+		vector<smoothPwd::StrProb> guesses;
+		model->threshold_search_shard([&](const string &s, double p) { if (is_new(s)) guesses.emplace_back(s, p); },
+			shard, num_shards, threshold());
+		sort(guesses.begin(), guesses.end(), [](const smoothPwd::StrProb &a, const smoothPwd::StrProb &b) { return a.second > b.second; });
+		auto emit = writer.producer();
+		for (const auto& n : guesses) {
+			emit(n.first, n.second);
+		}
+	}
+	else if (filter) {
+		auto guesses = model->generate_excluding(*filter, guess_num);
+		auto emit = writer.producer();
+		for (const auto& n : guesses) {
+			emit(n.first, n.second);
+		}
+	}
+	else { // packed guesses, radix-sorted on --threads threads
+		auto guesses = model->generate_compact(guess_num, exact, num_threads);
+		guesses.for_each(writer.producer());
+	}
+
+	writer.finish();
+	log << "generated " << writer.count() << " guesses, time: "
+		<< (double)(clock() - ts_clock) / CLOCKS_PER_SEC << endl;
+	if (out != stdout) fclose(out);
+	if (!writer.ok()) {
+		log << "failed writing " << output_path << endl;
+		return -1;
+	}
+	if (!rank_index_path.empty()) { // from the output as written, so its ranks are the output order
+		clock_t ix_clock = clock();
+		try {
+			auto index = smoothPwd::GuessRankIndex::from_guess_file(output_path, binary);
+			index.save(rank_index_path);
+			log << "rank index: " << index.size() << " guesses, " << index.bytes() / 1048576.0 << " MiB, time: "
+				<< (double)(clock() - ix_clock) / CLOCKS_PER_SEC << endl;
+		}
+		catch (const std::runtime_error &e) {
+			log << e.what() << endl;
+			return -1;
+		}
 	}
 	return 0;
 }
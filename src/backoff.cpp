@@ -62,8 +62,12 @@ void KatzBackoffModel::preprocess() {
 	root_nd.prob = 1.0 / (CHAR_NUM);
 
 	assert(tree[root].cnt_end > K);
-	get_probs(root);
+	{
+		MemoryPhase ph(phases, "get_probs", profiling());
+		get_probs(root);
+	}
 
+	MemoryPhase ph(phases, "interpolate", profiling());
 	// interpolate prob_end
 	std::queue<size_t> Q;
 	for (size_t ch_idx : root_nd.ch) Q.push(ch_idx);
@@ -16,7 +16,7 @@ namespace smoothPwd
 	public:
 		const ull K;
 
-		KatzBackoffModel(ull _K) : BaseTrieModel(MAX_GRAM_SIZE), K(_K) {};
+		KatzBackoffModel(ull _K, int _gram_size = MAX_GRAM_SIZE) : BaseTrieModel(_gram_size), K(_K) {};
 
 		void preprocess();
 	};
@@ -65,4 +65,33 @@ namespace smoothPwd
 			cnt_end = _cnt_end;
 		}
 	};
+
+	const size_t EDGE_BIT = ~(~(size_t)0 >> 1); // node ids with this bit set are EdgeNodes
+	const size_t NO_KID = ~(size_t)0;
+
+	class EdgeNode {
+		// a trained Node with at most one kid, folded into a compressed edge (the run of such nodes
+		// between two branching ones): no counts and no kid list, about a third of a Node's memory
+	public:
+		double prob, prob_end, b, pf; // as in Node
+		size_t fail;
+		size_t next;                  // the only kid; NO_KID at a leaf
+		char c;
+		int level;
+
+		EdgeNode(const Node &nd, size_t _next, size_t _fail) :
+			prob(nd.prob), prob_end(nd.prob_end), b(nd.b), pf(nd.pf), fail(_fail), next(_next), c(nd.c), level(nd.level) {}
+	};
+
+	struct FlatNode {
+		// a branching Node as a model image (see modelImage.hpp) stores it: no counts, and its kids in the
+		// image's kid array instead of a vector of its own
+		double prob, prob_end, b, pf; // as in Node
+		size_t fail;
+		size_t kids; // offset of the first kid in the kid array; sorted by char, like Node::ch
+		size_t num_kids;
+		bset v;      // as Node::v (at root, the end symbol is set too, though no kid)
+		char c;
+		int level;
+	};
 } // namespace smoothPwd
@@ -7,10 +7,22 @@
 
 #include <iostream>
 #include <queue>
+#include <thread>
 
 #include <cassert>
+#include <cmath>
 
 using smoothPwd::BaseTrieModel;
+using smoothPwd::SearchFrame;
+using smoothPwd::Node;
+using smoothPwd::NodeVector;
+using smoothPwd::FlatNode;
+using smoothPwd::EdgeNode;
+using smoothPwd::ModelImage;
+using smoothPwd::PageAllocator;
+using smoothPwd::PageMode;
+using smoothPwd::PasswordPolicy;
+using smoothPwd::NoPolicy;
 using smoothPwd::StrProb;
 using smoothPwd::ull;
 using smoothPwd::bset;
@@ -25,11 +37,13 @@ size_t BaseTrieModel::add_from_trie(char cur_char, size_t tx, ull prune, int lev
 	// just turn a simple trie subtree into a trie subtree for now;
 	// you can try out some pruning techniques with this function yourself.
 	// please make sure sn_cnt > K when calling this function!
+	// the simple trie may be counted at a larger gram size than ours; anything deeper is cut off here.
+	// (levels: root 0, start symbol 1; a gram size n trie has levels <= n, and [ed] only below level n)
 
 	SimpleNode &sn = s_trie->tree[tx];
 	int tot = (int)sn.ch.size();
 	assert(sn.cnt > prune);
-	ull cnt_end = sn.cnt_end > prune ? sn.cnt_end : 0;
+	ull cnt_end = (sn.cnt_end > prune && level < gram_size) ? sn.cnt_end : 0;
 	size_t idx = add_node(cur_char, level, sn.cnt, cnt_end, max(tot, 1));
 
 	if (tot == 0) { // leaf node; expand tail
@@ -43,7 +57,7 @@ size_t BaseTrieModel::add_from_trie(char cur_char, size_t tx, ull prune, int lev
 
 		size_t prev_idx = idx, ch_idx = idx;
 		int ch_level = level + 1;
-		while (sn.s[ptr] != '\0') { // create a chain of nodes
+		while (sn.s[ptr] != '\0' && ch_level <= gram_size) { // create a chain of nodes
 			char c = sn.s[ptr];
 			ch_idx = add_node(c, ch_level, sn.cnt, 0, 1);
 			tree[prev_idx].add_ch(c, ch_idx);
@@ -51,13 +65,14 @@ size_t BaseTrieModel::add_from_trie(char cur_char, size_t tx, ull prune, int lev
 			++ptr;
 			++ch_level;
 		}
-		tree[ch_idx].cnt_end = cnt_end; // real position of cnt_end
+		if (sn.s[ptr] == '\0' && ch_level - 1 < gram_size)
+			tree[ch_idx].cnt_end = (sn.cnt_end > prune) ? sn.cnt_end : 0; // real position of cnt_end
 
 		return idx;
 	}
 	else {
 		int ith = 0;
-		for (int i = 0; i < CHAR_NUM; i++) {
+		for (int i = 0; i < CHAR_NUM && level < gram_size; i++) {
 			if (ith >= tot)
 				break;
 			if (!sn.v[i])
@@ -75,6 +90,229 @@ size_t BaseTrieModel::add_from_trie(char cur_char, size_t tx, ull prune, int lev
 	}
 }
 
+void BaseTrieModel::blocked_layout(size_t idx, int height, vector<size_t> &order) const {
+	// lay out the top `height` levels of idx's subtree
+	if (height <= 1) {
+		order.push_back(idx);
+		return;
+	}
+	int top = height / 2;
+	blocked_layout(idx, top, order);
+
+	// then every subtree hanging below the top part, one after another
+	const TreeView t{ tree, edges };
+	vector<size_t> cur(1, idx), next;
+	for (int d = 0; d < top; d++) {
+		next.clear();
+		for (size_t x : cur) {
+			NodeRef nd = t.ref(x);
+			next.insert(next.end(), nd.kids, nd.kids + nd.num_kids);
+		}
+		cur.swap(next);
+	}
+	for (size_t x : cur) blocked_layout(x, height - top, order);
+}
+
+void BaseTrieModel::renumber(NodeLayout layout) {
+	if (image) return;
+	TraceSpan span("renumber");
+	const TreeView t{ tree, edges };
+	const size_t n = tree.size(), m = edges.size();
+	span.arg("nodes", (long long)(n + m));
+	// nodes and edge nodes are laid out alike; slot() puts both in one range
+	auto slot = [n](size_t idx) { return TreeView::is_edge(idx) ? n + (idx & ~EDGE_BIT) : idx; };
+	vector<size_t> order; // ids in their new order
+	order.reserve(n + m);
+
+	if (layout == LAYOUT_BFS || layout == LAYOUT_BLOCKED) {
+		std::queue<size_t> Q;
+		Q.push(root);
+		Q.push(start_idx); // not a kid of root
+		while (!Q.empty()) {
+			size_t idx = Q.front(); Q.pop();
+			order.push_back(idx);
+			NodeRef nd = t.ref(idx);
+			for (size_t i = 0; i < nd.num_kids; i++) Q.push(nd.kids[i]);
+		}
+	}
+	else {
+		std::priority_queue<std::pair<double, size_t> > Q; // (prob. of reaching, idx)
+		Q.emplace(2.0, root); // root first, whatever happens
+		Q.emplace(1.0, start_idx);
+		while (!Q.empty()) {
+			double p = Q.top().first;
+			size_t idx = Q.top().second;
+			Q.pop();
+			order.push_back(idx);
+			NodeRef nd = t.ref(idx);
+			for (size_t i = 0; i < nd.num_kids; i++) Q.emplace(std::min(p, 1.0) * t.prob(nd.kids[i]), nd.kids[i]);
+		}
+	}
+	if (layout == LAYOUT_BLOCKED) {
+		vector<int> height(n + m, 1); // height of each subtree; kids come after their parent in BFS order
+		for (size_t i = order.size(); i-- > 0; ) {
+			NodeRef nd = t.ref(order[i]);
+			for (size_t j = 0; j < nd.num_kids; j++)
+				height[slot(order[i])] = max(height[slot(order[i])], height[slot(nd.kids[j])] + 1);
+		}
+		order.clear();
+		blocked_layout(root, height[slot(root)], order);
+		blocked_layout(start_idx, height[slot(start_idx)], order);
+	}
+	assert(order.size() == n + m && order[0] == root); // root must stay 0 (see BaseNode::find_ch)
+
+	vector<size_t> new_idx(n + m);
+	size_t num_nodes = 0, num_edges = 0;
+	for (size_t idx : order)
+		new_idx[slot(idx)] = TreeView::is_edge(idx) ? (EDGE_BIT | num_edges++) : num_nodes++;
+	auto remap = [&new_idx, &slot](size_t idx) { return idx == NO_KID ? NO_KID : new_idx[slot(idx)]; };
+
+	NodeVector new_tree(tree.get_allocator());
+	EdgeVector new_edges(edges.get_allocator());
+	new_tree.reserve(n);
+	new_edges.reserve(m);
+	for (size_t idx : order) {
+		if (TreeView::is_edge(idx)) {
+			new_edges.push_back(edges[idx & ~EDGE_BIT]);
+			EdgeNode &en = new_edges.back();
+			en.next = remap(en.next);
+			en.fail = remap(en.fail);
+		}
+		else {
+			new_tree.push_back(std::move(tree[idx]));
+			Node &nd = new_tree.back();
+			for (size_t &ch_idx : nd.ch) ch_idx = remap(ch_idx);
+			nd.fail = remap(nd.fail);
+		}
+	}
+	tree.swap(new_tree);
+	edges.swap(new_edges);
+	root = remap(root);
+	start_idx = remap(start_idx);
+	replicas.clear();
+}
+
+void BaseTrieModel::compress_edges() {
+	if (!edges.empty()) return; // done already
+	TraceSpan span("compress_edges");
+	const size_t n = tree.size();
+	vector<size_t> new_idx(n);
+	size_t num_nodes = 0, num_edges = 0;
+	for (size_t idx = 0; idx < n; idx++) { // keeps the order (and so the layout) of both kinds
+		bool fold = idx != root && idx != start_idx && tree[idx].ch.size() <= 1;
+		new_idx[idx] = fold ? (EDGE_BIT | num_edges++) : num_nodes++;
+	}
+	if (num_edges == 0) return;
+
+	NodeVector new_tree(tree.get_allocator());
+	EdgeVector new_edges(PageAllocator<EdgeNode>(tree.get_allocator().mode));
+	new_tree.reserve(num_nodes);
+	new_edges.reserve(num_edges);
+	for (size_t idx = 0; idx < n; idx++) {
+		Node &nd = tree[idx];
+		if (TreeView::is_edge(new_idx[idx])) {
+			new_edges.emplace_back(nd, nd.ch.empty() ? NO_KID : new_idx[nd.ch[0]], new_idx[nd.fail]);
+		}
+		else {
+			new_tree.push_back(std::move(nd));
+			Node &moved = new_tree.back();
+			for (size_t &ch_idx : moved.ch) ch_idx = new_idx[ch_idx];
+			moved.fail = new_idx[moved.fail];
+		}
+	}
+	tree.swap(new_tree);
+	edges.swap(new_edges);
+	assert(new_idx[root] == 0);
+	root = new_idx[root];
+	start_idx = new_idx[start_idx];
+	replicas.clear();
+	span.arg("nodes", (long long)num_nodes);
+	span.arg("edge_nodes", (long long)num_edges);
+}
+
+void BaseTrieModel::use_huge_pages(PageMode mode) {
+	if (image) return;
+	TraceSpan span("use_huge_pages");
+	PageAllocator<Node> alloc(mode);
+	NodeVector moved(alloc);
+	moved.reserve(tree.size());
+	for (auto &nd : tree) moved.push_back(std::move(nd));
+	tree.swap(moved);
+	EdgeVector moved_edges(edges.begin(), edges.end(), PageAllocator<EdgeNode>(mode));
+	edges.swap(moved_edges);
+	replicas.clear();
+}
+
+size_t BaseTrieModel::replicate_numa() {
+	TraceSpan span("replicate_numa");
+	replicas.clear();
+	int num_nodes = numa_num_nodes();
+	if (num_nodes <= 1 || image) return 1;
+
+	vector<std::unique_ptr<const Replica> > copies(num_nodes);
+	vector<std::thread> workers;
+	for (int k = 0; k < num_nodes; k++) {
+		workers.emplace_back([this, k, &copies]() {
+			// first touch from a thread running on node k puts the copy (kid lists included) there
+			if (numa_bind_thread(k)) copies[k].reset(new Replica{ tree, edges });
+		});
+	}
+	for (auto &t : workers) t.join();
+
+	size_t served = 0;
+	for (const auto &c : copies) served += c ? 1 : 0;
+	if (served <= 1) return 1; // only one node usable; the tree itself will do
+	replicas.swap(copies);
+	return served;
+}
+
+vector<int> BaseTrieModel::replica_nodes() const {
+	vector<int> nodes;
+	for (size_t k = 0; k < replicas.size(); k++) {
+		if (replicas[k]) nodes.push_back((int)k);
+	}
+	return nodes;
+}
+
+void BaseTrieModel::save_image(const string &path) const {
+	if (image) {
+		ModelImage::save(path, gram_size, root, start_idx, image->nodes(), image->num_nodes, image->edges(), image->num_edges, image->kids(), image->num_kids);
+		return;
+	}
+	vector<FlatNode> flat(tree.size()); // value-initialized: no stray padding bytes in the file
+	vector<size_t> kids;
+	for (size_t i = 0; i < tree.size(); i++) {
+		const Node &nd = tree[i];
+		FlatNode &fn = flat[i];
+		fn.prob = nd.prob;
+		fn.prob_end = nd.prob_end;
+		fn.b = nd.b;
+		fn.pf = nd.pf;
+		fn.fail = nd.fail;
+		fn.kids = kids.size();
+		fn.num_kids = nd.ch.size();
+		fn.v = nd.v;
+		fn.c = nd.c;
+		fn.level = nd.level;
+		kids.insert(kids.end(), nd.ch.begin(), nd.ch.end());
+	}
+	ModelImage::save(path, gram_size, root, start_idx, flat.data(), flat.size(), edges.data(), edges.size(), kids.data(), kids.size());
+}
+
+void BaseTrieModel::map_image(const string &path) {
+	if (image || !tree.empty()) throw std::logic_error("map_image: the model has a tree already");
+	std::shared_ptr<const ModelImage> img = ModelImage::map(path);
+	if (img->gram_size != gram_size)
+		throw std::invalid_argument("image of gram size " + std::to_string(img->gram_size) +
+			" cannot serve a model of gram size " + std::to_string(gram_size));
+	image = img;
+	root = image->root;
+	start_idx = image->start_idx;
+	s_trie.reset();
+	replicas.clear();
+	phases.clear();
+}
+
 void BaseTrieModel::aggressive_prune() {
 	// experimental feature
 }
@@ -108,15 +346,67 @@ void BaseTrieModel::get_fail() {
 	}
 }
 
+size_t BaseTrieModel::add_from_runs(ull prune) {
+	// records come in key order, i.e. a pre-order walk of the count trie: nodes are created in the same
+	// order as add_from_trie does, and a record's parent is the last node one level up
+	vector<size_t> path; // path[l]: node at level l on the current branch
+	size_t first = tree.size();
+	count_nodes = 0;
+	count_bytes = 0;
+	ext_counts->merge([&](const string &key, ull cnt, ull cnt_end) {
+		int level = (int)key.size();
+		++count_nodes;
+		while ((int)path.size() > level) { // leaving a subtree
+			tree[path.back()].ch.shrink_to_fit();
+			path.pop_back();
+		}
+		if (level > gram_size || cnt <= prune || (int)path.size() < level) return; // too deep, or (below) a pruned node
+
+		char c = (level == 0 || key.back() == START_KEY) ? '\0' : key.back();
+		size_t idx = add_node(c, level, cnt, (cnt_end > prune && level < gram_size) ? cnt_end : 0, 1);
+		if (level > 0) tree[path.back()].add_ch(c, idx);
+		path.push_back(idx);
+	});
+	for (size_t idx : path) tree[idx].ch.shrink_to_fit();
+	if (tree.size() == first)
+		throw std::runtime_error("no counts to build a model from");
+	return first;
+}
+
 void BaseTrieModel::build_trie(ull prune) {
-	root = add_from_trie('\0', s_trie->root, prune, 0);
-	tree.shrink_to_fit();
-	s_trie.reset(nullptr);
+	MemoryPhase ph(phases, "build_trie", profiling());
+	if (ext_counts != nullptr) {
+		TraceSpan span("add_from_runs");
+		span.arg("runs", (long long)ext_counts->num_runs());
+		root = add_from_runs(prune);
+		tree.shrink_to_fit();
+		span.arg("nodes", (long long)tree.size());
+		ph.arg("count_nodes", (long long)count_nodes);
+	}
+	else {
+		if (profiling()) {
+			TrieStats counts = s_trie->stats();
+			count_nodes = counts.num_nodes;
+			count_bytes = counts.tree_bytes;
+			ph.arg("count_nodes", (long long)count_nodes);
+		}
+		else count_nodes = count_bytes = 0;
+		TraceSpan span("add_from_trie");
+		root = add_from_trie('\0', s_trie->root, prune, 0);
+		tree.shrink_to_fit();
+		span.arg("nodes", (long long)tree.size());
+	}
+	edges.clear();
+	replicas.clear();
+	s_trie.reset(); // shared counts stay alive for other models
 
 	// set fail edges
 	start_idx = tree[root].find_ch('\0');
 	tree[root].fail = root;
-	get_fail();
+	{
+		TraceSpan span("get_fail");
+		get_fail();
+	}
 
 	// remove start_idx from root's children
 	tree[root].remove_ch('\0');
@@ -124,15 +414,28 @@ void BaseTrieModel::build_trie(ull prune) {
 	tree[root].cnt_end = tree[start_idx].cnt;
 }
 
-double BaseTrieModel::ch_prob(size_t pred, char c, size_t &nt) const {
-	const Node &pred_nd = tree[pred];
+double BaseTrieModel::ch_prob(const TreeView &t, size_t pred, char c, size_t &nt) const {
+	if (TreeView::is_edge(pred)) { // inside a compressed edge: one kid at most, and never root
+		const EdgeNode &en = t.edge(pred);
+		if (c == '\0') {
+			return en.prob_end;
+		}
+		else if (en.next != NO_KID && t.c(en.next) == c) {
+			nt = en.next;
+			return t.prob(en.next);
+		}
+		nt = en.fail;
+		return en.b * ch_prob(t, en.fail, c, nt);
+	}
+
+	const NodeRef pred_nd = t.branch(pred);
 	if (c == '\0') {
 		return pred_nd.prob_end; // is precomputed even if pred_nd.cnt_end == 0
 	}
-	else if (pred_nd.has_ch(c)) { // found
-		size_t ch_idx = pred_nd.find_ch(c);
+	else if (pred_nd.has_kid(c)) { // found
+		size_t ch_idx = pred_nd.kid(c);
 		nt = ch_idx;
-		return tree[ch_idx].prob;
+		return t.prob(ch_idx);
 	}
 	else { // not found
 		size_t fail_idx = pred_nd.fail;
@@ -140,68 +443,242 @@ double BaseTrieModel::ch_prob(size_t pred, char c, size_t &nt) const {
 		if (pred == root) // reached root; stop failing
 			return pred_nd.b * pred_nd.prob;
 		else
-			return pred_nd.b * ch_prob(fail_idx, c, nt);
+			return pred_nd.b * ch_prob(t, fail_idx, c, nt);
 	}
 }
 
-void BaseTrieModel::ch_search(size_t idx, string &s, const bset v, double p) const {
-	const Node &nd = tree[idx];
-	if (p * nd.pf <= PRUNE_EPS * min_threshold) return; // pruned
+void BaseTrieModel::expand_frame(const TreeView &t, const SearchFrame &fr, double min_thres, vector<SearchFrame> &out) const {
+	// one level of ch_search: the frames it would recurse into, in the same order.
+	// the end symbol gets a frame of its own, with every other char banned
+	const NodeRef nd = t.ref(fr.idx);
+	if (fr.p * nd.pf <= PRUNE_EPS * min_thres) return; // pruned
 
-	if (!v[end_ord]) { // end symbol
-		double ch_p = p * nd.prob_end;
-		if (ch_p > min_threshold && ch_p <= max_threshold) // (min_threshold, max_threshold]
-			oracle(s, ch_p);
+	if (!fr.v[end_ord] && fr.p * nd.prob_end > min_thres) {
+		bset end_v;
+		end_v.set();
+		end_v.reset(end_ord);
+		out.emplace_back(fr.idx, end_v, fr.p, fr.s);
 	}
 
-	for (size_t ch_idx : nd.ch) {
-		const Node &cur_ch = tree[ch_idx];
-		char c = cur_ch.c;
-		if (v[ord(c)])
+	for (size_t i = 0; i < nd.num_kids; i++) {
+		size_t ch_idx = nd.kids[i];
+		char c = t.c(ch_idx);
+		if (fr.v[ord(c)])
 			continue; // banned
-		else {
-			double ch_p = p * cur_ch.prob;
-			if (ch_p <= min_threshold)
-				continue; // pruned
-			s.push_back(c);
-			ch_search(ch_idx, s, empty_bset, ch_p);
-			s.pop_back();
-		}
+		double ch_p = fr.p * t.prob(ch_idx);
+		if (ch_p <= min_thres)
+			continue; // pruned
+		out.emplace_back(ch_idx, empty_bset, ch_p, fr.s + c);
 	}
 
-	double fail_p = p * nd.b;
-	if (fail_p <= min_threshold)
-		return; // not much prob. left
+	double fail_p = fr.p * nd.b;
+	if (fail_p <= min_thres)
+		return;
 
-	bset fail_v = v | (nd.v);
+	bset fail_v = fr.v | (nd.v);
 	fail_v.set(end_ord);
 
 	if (fail_v.all())
-		return; // no need to fail
+		return;
 
-	if (idx == root) {
-		assert(fail_v[end_ord]); // \0 is always banned
-
-		fail_p = fail_p * tree[root].prob;
-		if (fail_p <= min_threshold)
+	if (fr.idx == root) {
+		fail_p = fail_p * nd.prob;
+		if (fail_p <= min_thres)
 			return;
-
 		for (int i = 0; i < CHAR_NUM; i++) {
-			if (fail_v[i])
-				continue;
-			char c = chr(i);
-			s.push_back(c);
-			ch_search(root, s, empty_bset, fail_p);
-			s.pop_back();
+			if (!fail_v[i])
+				out.emplace_back(root, empty_bset, fail_p, fr.s + chr(i));
 		}
 	}
 	else {
-		ch_search(nd.fail, s, fail_v, fail_p);
+		out.emplace_back(nd.fail, fail_v, fail_p, fr.s);
+	}
+}
+
+BaseTrieModel::SearchIterator BaseTrieModel::search_iterator(double min_thres, double max_thres) const {
+	return SearchIterator(*this, vector<SearchFrame>(1, SearchFrame(start_idx, empty_bset, 1.0, string())), min_thres, max_thres);
+}
+
+BaseTrieModel::SearchIterator::SearchIterator(const BaseTrieModel &_model, const vector<SearchFrame> &frames, double _min_thres, double _max_thres) :
+	model(&_model), min_thres(_min_thres), max_thres(_max_thres) {
+	for (size_t k = frames.size(); k-- > 0;) { // the first frame on top
+		seeds.push_back(frames[k].s);
+		stack.push_back(Frame{ frames[k].idx, frames[k].v, frames[k].p, 0, FROM_SEED - (int)(seeds.size() - 1) });
 	}
 }
 
-tuple<char, double, size_t> BaseTrieModel::sample_ch(size_t idx, const bset v, double rand_val) const {
-	const Node &nd = tree[idx];
+bool BaseTrieModel::SearchIterator::expand(const TreeView &t, const Frame &fr, StrProb &out) {
+	// ch_search(fr) with its recursive calls pushed instead, last one first, so that they pop in order
+	const size_t len = s.size();
+	bool emitted = false;
+	auto emit = [&](double ch_p) {
+		out.first.assign(s);
+		out.second = ch_p;
+		emitted = true;
+	};
+
+	if (TreeView::is_edge(fr.idx)) {
+		const EdgeNode &en = t.edge(fr.idx);
+		if (fr.p * en.pf <= PRUNE_EPS * min_thres) return false; // pruned
+		if (!fr.v[end_ord]) {
+			double ch_p = fr.p * en.prob_end;
+			if (ch_p > min_thres && ch_p <= max_thres) emit(ch_p);
+		}
+		bset fail_v = fr.v;
+		fail_v.set(end_ord);
+		bool kid = false;
+		double kid_p = 0;
+		if (en.next != NO_KID) {
+			char c = t.c(en.next);
+			if (!fr.v[ord(c)]) {
+				kid_p = fr.p * t.prob(en.next);
+				kid = kid_p > min_thres;
+			}
+			fail_v.set(ord(c));
+		}
+		double fail_p = fr.p * en.b;
+		if (fail_p > min_thres && !fail_v.all())
+			stack.push_back(Frame{ en.fail, fail_v, fail_p, len, NO_CHAR });
+		if (kid)
+			stack.push_back(Frame{ en.next, empty_bset, kid_p, len, (unsigned char)t.c(en.next) });
+		return emitted;
+	}
+
+	const NodeRef nd = t.branch(fr.idx);
+	if (fr.p * nd.pf <= PRUNE_EPS * min_thres) return false; // pruned
+	if (!fr.v[end_ord]) {
+		double ch_p = fr.p * nd.prob_end;
+		if (ch_p > min_thres && ch_p <= max_thres) emit(ch_p);
+	}
+
+	double fail_p = fr.p * nd.b;
+	bset fail_v = fr.v | (nd.v);
+	fail_v.set(end_ord);
+	if (fail_p > min_thres && !fail_v.all()) {
+		if (fr.idx == model->root) {
+			fail_p = fail_p * nd.prob;
+			if (fail_p > min_thres) {
+				for (int i = CHAR_NUM; i-- > 0;) {
+					if (!fail_v[i]) stack.push_back(Frame{ model->root, empty_bset, fail_p, len, (unsigned char)chr(i) });
+				}
+			}
+		}
+		else stack.push_back(Frame{ nd.fail, fail_v, fail_p, len, NO_CHAR });
+	}
+
+	for (size_t i = nd.num_kids; i-- > 0;) {
+		size_t ch_idx = nd.kids[i];
+		char c = t.c(ch_idx);
+		if (fr.v[ord(c)]) continue; // banned
+		double ch_p = fr.p * t.prob(ch_idx);
+		if (ch_p > min_thres) stack.push_back(Frame{ ch_idx, empty_bset, ch_p, len, (unsigned char)c });
+	}
+	return emitted;
+}
+
+size_t BaseTrieModel::SearchIterator::next_batch(StrProb *out, size_t n) {
+	const TreeView t = model->local_view(); // of the thread asking; the iterator may move between threads
+	size_t k = 0;
+	while (k < n && !stack.empty()) { // a frame emits one guess at most
+		Frame fr = stack.back();
+		stack.pop_back();
+		if (fr.c <= FROM_SEED) s = seeds[FROM_SEED - fr.c];
+		else {
+			s.resize(fr.len);
+			if (fr.c != NO_CHAR) s.push_back((char)fr.c);
+		}
+		if (expand(t, fr, out[k])) ++k;
+	}
+	return k;
+}
+
+vector<SearchFrame> BaseTrieModel::SearchIterator::pending() const {
+	vector<SearchFrame> frames;
+	for (size_t k = stack.size(); k-- > 0;) {
+		const Frame &fr = stack[k];
+		string fs = fr.c <= FROM_SEED ? seeds[FROM_SEED - fr.c] : s.substr(0, fr.len);
+		if (fr.c >= 0) fs.push_back((char)fr.c);
+		frames.emplace_back(fr.idx, fr.v, fr.p, fs);
+	}
+	return frames;
+}
+
+namespace
+{
+	const size_t frames_per_part = 64;
+}
+
+vector<vector<SearchFrame> > BaseTrieModel::split_search(size_t num_shards, double min_thres) const {
+	// a frame weighs as many guesses as it holds above a coarser threshold (cheap to count, yet ~16
+	// guesses per frame on average)
+	vector<SearchFrame> frames;
+	frames.emplace_back(start_idx, empty_bset, 1.0, string());
+	return split_frames(frames, num_shards, min_thres,
+		std::max(min_thres, generate_threshold(num_shards * frames_per_part * 16)));
+}
+
+vector<vector<SearchFrame> > BaseTrieModel::split_shard(size_t shard, size_t num_shards, size_t num_parts, double min_thres) const {
+	// the shard holds ~1/num_shards of the guesses, so the same ~16 per frame take a finer threshold
+	return split_frames(shard_frames(shard, num_shards, min_thres), num_parts, min_thres,
+		std::max(min_thres, generate_threshold(num_shards * num_parts * frames_per_part * 16)));
+}
+
+vector<vector<SearchFrame> > BaseTrieModel::split_frames(vector<SearchFrame> frames, size_t num_parts, double min_thres, double coarse_thres) const {
+	// split the frames into many small ones, keeping DFS order, then cut that sequence into num_parts
+	// contiguous runs of equal weight; prob. mass breaks ties between frames of equal count
+	const int max_rounds = 64;
+
+	const TreeView t = local_view();
+	auto weight = [this, &t, coarse_thres](const SearchFrame &fr) {
+		ull cnt = 0;
+		auto tally = [&cnt](double, ull mult) { cnt += mult; return true; };
+		tally_from(tally, t, fr.idx, fr.v, fr.p, coarse_thres, 1.0, 1);
+		return (double)cnt + fr.p;
+	};
+
+	vector<SearchFrame> next_frames;
+	vector<double> w, next_w;
+	for (const auto &fr : frames) w.push_back(weight(fr));
+	for (int round = 0; round < max_rounds; round++) {
+		double tot = 0.0;
+		for (double x : w) tot += x;
+		double grain = tot / (num_parts * frames_per_part);
+
+		bool changed = false;
+		next_frames.clear();
+		next_w.clear();
+		for (size_t i = 0; i < frames.size(); i++) {
+			const SearchFrame &fr = frames[i];
+			bool end_only = fr.v.count() == CHAR_NUM - 1 && !fr.v[end_ord];
+			if (w[i] <= grain || end_only) {
+				next_frames.push_back(fr);
+				next_w.push_back(w[i]);
+			}
+			else {
+				size_t first = next_frames.size();
+				expand_frame(t, fr, min_thres, next_frames);
+				for (size_t j = first; j < next_frames.size(); j++) next_w.push_back(weight(next_frames[j]));
+				changed = true;
+			}
+		}
+		frames.swap(next_frames);
+		w.swap(next_w);
+		if (!changed) break;
+	}
+
+	double tot = 0.0, cum = 0.0;
+	for (double x : w) tot += x;
+	vector<vector<SearchFrame> > parts(num_parts);
+	for (size_t i = 0; i < frames.size(); i++) {
+		size_t owner = std::min(num_parts - 1, (size_t)((cum + w[i] / 2) / tot * num_parts));
+		cum += w[i];
+		parts[owner].push_back(frames[i]);
+	}
+	return parts;
+}
+
+tuple<char, double, size_t> BaseTrieModel::sample_ch(const TreeView &t, size_t idx, const bset v, double rand_val) const {
+	const NodeRef nd = t.ref(idx);
 
 	if (!v[end_ord]) {
 		double prob = nd.prob_end;
@@ -210,13 +687,13 @@ tuple<char, double, size_t> BaseTrieModel::sample_ch(size_t idx, const bset v, d
 			return make_tuple('\0', prob, idx);
 	}
 
-	for (size_t ch_idx : nd.ch) {
-		const Node &cur_ch = tree[ch_idx];
-		char c = cur_ch.c;
+	for (size_t i = 0; i < nd.num_kids; i++) {
+		size_t ch_idx = nd.kids[i];
+		char c = t.c(ch_idx);
 		if (v[ord(c)])
 			continue; // banned
 		else {
-			double prob = cur_ch.prob;
+			double prob = t.prob(ch_idx);
 			rand_val -= prob;
 			if (rand_val < 0)
 				return make_tuple(c, prob, ch_idx);
@@ -246,20 +723,86 @@ tuple<char, double, size_t> BaseTrieModel::sample_ch(size_t idx, const bset v, d
 	}
 	else {
 		assert(nd.b > 0.0);
-		auto res = sample_ch(nd.fail, fail_v, rand_val / nd.b);
+		auto res = sample_ch(t, nd.fail, fail_v, rand_val / nd.b);
 		get<1>(res) *= nd.b;
 		return res;
 	}
 }
 
+smoothPwd::TrieStats BaseTrieModel::stats() const {
+	TrieStats st;
+	if (image) { // one block: the file, which the page cache holds
+		st.num_nodes = st.node_capacity = image->num_nodes;
+		st.edge_nodes = image->num_edges;
+		st.kids = st.kid_capacity = image->num_kids;
+		for (size_t i = 0; i < image->num_nodes + image->num_edges; i++) {
+			int level = i < image->num_nodes ? image->nodes()[i].level : image->edges()[i - image->num_nodes].level;
+			if ((size_t)level >= st.level_nodes.size()) st.level_nodes.resize(level + 1, 0);
+			st.level_nodes[level]++;
+		}
+		st.tree_bytes = image->bytes();
+		return st;
+	}
+	st.num_nodes = tree.size();
+	st.node_capacity = tree.capacity();
+	for (const auto &nd : tree) {
+		if ((size_t)nd.level >= st.level_nodes.size()) st.level_nodes.resize(nd.level + 1, 0);
+		st.level_nodes[nd.level]++;
+		st.kids += nd.ch.size();
+		st.kid_capacity += nd.ch.capacity();
+	}
+	for (const auto &en : edges) {
+		if ((size_t)en.level >= st.level_nodes.size()) st.level_nodes.resize(en.level + 1, 0);
+		st.level_nodes[en.level]++;
+	}
+	st.edge_nodes = edges.size();
+	st.tree_bytes = st.node_capacity * sizeof(Node) + st.kid_capacity * sizeof(size_t) + edges.capacity() * sizeof(EdgeNode);
+	for (const auto &r : replicas) st.replicas += r ? 1 : 0;
+	st.count_nodes = count_nodes;
+	st.count_bytes = count_bytes;
+	st.phases = phases;
+	return st;
+}
+
+uint64_t BaseTrieModel::fingerprint() const {
+	// a sum of per-node hashes, so the order of the nodes (their layout) does not matter
+	struct Fields {
+		double prob, prob_end, b, pf;
+		uint64_t c_level_kids;
+	};
+	auto node_hash = [](double prob, double prob_end, double b, double pf, char c, int level, size_t kids) {
+		Fields f = { prob, prob_end, b, pf, (uint64_t)(unsigned char)c << 56 | (uint64_t)(uint32_t)level << 24 | (uint64_t)kids };
+		return GuessFilter::hash(reinterpret_cast<const char *>(&f), sizeof(f));
+	};
+	auto edge_hash = [&node_hash](const EdgeNode &en) { return node_hash(en.prob, en.prob_end, en.b, en.pf, en.c, en.level, en.next == NO_KID ? 0 : 1); };
+	uint64_t h;
+	if (image) { // same nodes, same fingerprint as the model the image was saved from
+		h = (uint64_t)gram_size << 32 ^ (image->num_nodes + image->num_edges);
+		for (size_t i = 0; i < image->num_nodes; i++) {
+			const FlatNode &fn = image->nodes()[i];
+			h += node_hash(fn.prob, fn.prob_end, fn.b, fn.pf, fn.c, fn.level, fn.num_kids);
+		}
+		for (size_t i = 0; i < image->num_edges; i++) h += edge_hash(image->edges()[i]);
+	}
+	else {
+		h = (uint64_t)gram_size << 32 ^ (tree.size() + edges.size());
+		for (const auto &nd : tree) h += node_hash(nd.prob, nd.prob_end, nd.b, nd.pf, nd.c, nd.level, nd.ch.size());
+		for (const auto &en : edges) h += edge_hash(en);
+	}
+	return GuessFilter::hash(reinterpret_cast<const char *>(&h), sizeof(h));
+}
+
 void BaseTrieModel::sanity_check() {
-	for (size_t idx = 0; idx < tree.size(); idx++) {
+	const TreeView t{ tree, edges };
+	for (size_t k = 0; k < tree.size() + edges.size(); k++) {
+		size_t idx = k < tree.size() ? k : (EDGE_BIT | (k - tree.size()));
+		bool direct_end = !TreeView::is_edge(idx) && tree[idx].cnt_end > 0; // edge nodes keep no counts
 		size_t nt;
 		double cum_prob = 0.0, direct_prob = 0.0, fail_prob = 0.0;
 		for (int i = 0; i < CHAR_NUM; i++) {
 			char c = chr(i);
-			double cur_prob = ch_prob(idx, c, nt);
-			if (tree[idx].has_ch(c) || (c == '\0' && tree[idx].cnt_end > 0)) direct_prob += cur_prob;
+			double cur_prob = ch_prob(t, idx, c, nt);
+			if (t.ref(idx).v[ord(c)] || (c == '\0' && direct_end)) direct_prob += cur_prob;
 			else fail_prob += cur_prob;
 			cum_prob += cur_prob;
 		}
@@ -269,7 +812,7 @@ void BaseTrieModel::sanity_check() {
 			std::cerr << idx << " " << cum_prob << " " << direct_prob << " " << fail_prob << std::endl;
 			for (int j = 0; j < CHAR_NUM; j++) {
 				char c = chr(j);
-				std::cerr << "--" << c << "--: " << ch_prob(idx, c, nt) << std::endl;
+				std::cerr << "--" << c << "--: " << ch_prob(t, idx, c, nt) << std::endl;
 			}
 			throw "Trie Error";
 		}
@@ -277,13 +820,14 @@ void BaseTrieModel::sanity_check() {
 }
 
 double BaseTrieModel::pwd_prob(const char *s) const {
+	const TreeView t = local_view();
 	size_t nt = start_idx;
 	size_t len = strlen(s);
 	double p = 1.0;
 
 	for (size_t i = 0; i <= len && p > 0.0; i++) { // include end symbol
 		size_t cur = nt;
-		p *= ch_prob(cur, s[i], nt);
+		p *= ch_prob(t, cur, s[i], nt);
 		//std::cout << s << ": " << cur << " " << tree[cur].c << "->" 
 		//	<< nt << " " << tree[nt].c << ", " << p << std::endl;
 		if (p == 0.0) break;
@@ -291,14 +835,123 @@ double BaseTrieModel::pwd_prob(const char *s) const {
 	return p;
 }
 
-StrProb BaseTrieModel::sample() {
+namespace
+{
+	inline void prefetch(const void *p) {
+#if defined(__GNUC__) || defined(__clang__)
+		__builtin_prefetch(p);
+#else
+		(void)p;
+#endif
+	}
+}
+
+void BaseTrieModel::pwd_prob_batch(const char *const *pwds, size_t n, double *probs) const {
+	const TreeView t = local_view();
+	if (t.flat) prob_batch(t.flat_view(), pwds, n, probs);
+	else prob_batch(t.node_view(), pwds, n, probs);
+}
+
+template <typename View>
+void BaseTrieModel::prob_batch(const View &t, const char *const *pwds, size_t n, double *probs) const {
+	// every round advances each lane by one transition -- a kid or a fail link -- and prefetches the
+	// record that lane reads next; the lanes are independent, so their misses are in flight together.
+	// a kid is taken in two halves (found now, its prob. read next round), a lane that is done takes
+	// the next password
+	struct Lane {
+		const char *s; // next char
+		size_t cur;    // node the next char is read at
+		size_t kid;    // kid found for *s, whose prob. is still to be read; NO_KID if none
+		double p, f;   // prob. so far; backoff factors of the current char
+		size_t id;
+	};
+	Lane lanes[BATCH_LANES];
+	int active = 0;
+	size_t next = 0;
+	auto start = [&](Lane &ln) {
+		ln = Lane{ pwds[next], start_idx, NO_KID, 1.0, 1.0, next };
+		++next;
+	};
+	while (active < BATCH_LANES && next < n) start(lanes[active++]);
+
+	while (active > 0) {
+		for (int l = 0; l < active; l++) {
+			Lane &ln = lanes[l];
+			bool done = false;
+			if (ln.kid != NO_KID) { // second half of a kid: its record has been prefetched
+				ln.p *= ln.f * t.prob(ln.kid);
+				ln.f = 1.0;
+				ln.cur = ln.kid;
+				ln.kid = NO_KID;
+				++ln.s;
+				done = ln.p == 0.0;
+			}
+			if (!done) {
+				char c = *ln.s;
+				size_t nt = NO_KID;
+				if (TreeView::is_edge(ln.cur)) {
+					const EdgeNode &en = t.edge(ln.cur);
+					if (c == '\0') {
+						ln.p *= ln.f * en.prob_end;
+						done = true;
+					}
+					else if (en.next != NO_KID && t.c(en.next) == c) {
+						ln.kid = en.next;
+					}
+					else {
+						ln.f *= en.b;
+						nt = en.fail;
+					}
+				}
+				else {
+					const auto &nd = t.branch(ln.cur);
+					if (c == '\0') {
+						ln.p *= ln.f * nd.prob_end;
+						done = true;
+					}
+					else if (nd.v[ord(c)]) {
+						ln.kid = t.find_kid(nd, c);
+					}
+					else if (ln.cur == root) { // stop failing
+						ln.p *= ln.f * (nd.b * nd.prob);
+						ln.f = 1.0;
+						++ln.s;
+						nt = nd.fail;
+						done = ln.p == 0.0;
+					}
+					else {
+						ln.f *= nd.b;
+						nt = nd.fail;
+					}
+				}
+				if (nt != NO_KID) ln.cur = nt;
+				if (!done) {
+					size_t rec = ln.kid != NO_KID ? ln.kid : ln.cur;
+					prefetch(t.record(rec));
+				}
+			}
+			if (done) {
+				probs[ln.id] = ln.p;
+				if (next < n) start(ln);
+				else {
+					ln = lanes[--active]; // the last lane takes this one's place and is served now
+					--l;
+				}
+			}
+		}
+	}
+}
+
+template <typename Uniform>
+StrProb BaseTrieModel::sample_with(Uniform &&uniform) const {
 	// TODO: a somewhat costly implementation for now; will consider improving it later
+	const TreeView t = local_view();
 	string s;
 	double p = 1.0;
 	size_t idx = start_idx;
 	while (true) {
-		double rand_val = unif(re);
-		auto res = sample_ch(idx, empty_bset, rand_val); // the real search part
+		double rand_val = uniform();
+		auto res = sample_ch(t, idx, empty_bset, rand_val); // the real search part
 		//DEBUG
 
 		double trans_prob = get<1>(res);
@@ -318,6 +971,31 @@ StrProb BaseTrieModel::sample() {
 	assert(fabs(p - pwd_prob(s.c_str())) < EPS);
 	return StrProb(s, p);
 }
+
+StrProb BaseTrieModel::sample() {
+	return sample_with([this]() { return unif(re); });
+}
+
+StrProb BaseTrieModel::sample(SampleStream &rng) const {
+	return sample_with([&rng]() { return rng.uniform(); });
+}
+
+vector<StrProb> BaseTrieModel::sample_many(size_t n, ull seed, size_t num_threads) const {
+	if (num_threads == 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+	num_threads = std::min(num_threads, std::max(n, (size_t)1));
+	vector<StrProb> samples(n);
+	auto work = [this, &samples, n, seed, num_threads](size_t t) {
+		for (size_t i = n * t / num_threads; i < n * (t + 1) / num_threads; i++) {
+			SampleStream rng(seed, i);
+			samples[i] = sample(rng);
+		}
+	};
+	vector<std::thread> workers;
+	for (size_t t = 1; t < num_threads; t++) workers.emplace_back(work, t);
+	work(0);
+	for (auto &w : workers) w.join();
+	return samples;
+}
 /*
 StrProb BaseTrieModel::sample_brute() {
 	// reference implementation; try not to use it
@@ -348,36 +1026,124 @@ StrProb BaseTrieModel::sample_brute() {
 }
 */
 
-vector<StrProb> BaseTrieModel::generate(ull cnt, bool strict) {
+ull BaseTrieModel::count_by_threshold(double min_thres, double max_thres, ull limit) const {
+	ull cnt = 0;
+	if (limit == 0) return cnt;
+	threshold_tally([&cnt, limit](double, ull mult) {
+		cnt = mult >= limit - cnt ? limit : cnt + mult;
+		return cnt < limit;
+	}, min_thres, max_thres);
+	return cnt;
+}
+
+double BaseTrieModel::find_threshold(ull cnt) const {
+	if (cnt == 0) return 1.0;
+	double upper, lower = bucket_threshold(cnt, upper, NoPolicy());
+	if (lower == 0.0) return 0.0;
+
+	// exact probabilities inside (lower, upper]; the need-th largest is the last one we keep
+	ull above = 0;
+	vector<std::pair<double, ull> > items;
+	threshold_tally([&items, &above, upper](double p, ull mult) {
+		if (p > upper) above += mult;
+		else items.emplace_back(p, mult);
+		return true;
+	}, lower);
+	sort(items.begin(), items.end(), std::greater<std::pair<double, ull> >());
+
+	ull need = cnt - above;
+	size_t pos = 0;
+	for (ull acc = items[0].second; acc < need; acc += items[pos].second) ++pos;
+	double thres = nextafter(items[pos].first, 0.0);
+	assert(count_by_threshold(thres, 1.0, cnt) >= cnt);
+	return thres;
+}
+
+vector<StrProb> BaseTrieModel::generate(ull cnt, bool strict) const {
 	// reference: Ma et al., "A Study of Probabilistic Password Models". Oakland'14. 
+	// the threshold is found by counting only, so a single emitting search is run.
 	// it's possible that this implementation would produce (a small number of) duplicates.
-	vector<StrProb> guesses;
-	oracle = [&guesses](string &s, double p) { guesses.emplace_back(s, p); };
-	min_threshold = 1.0 / cnt; max_threshold = 1.0; // start with a conservative range of (1/cnt, 1]
-	while (guesses.size() < cnt) {
-		string s;
-		ch_search(start_idx, s, empty_bset, 1.0); // the real search part
-		size_t guesses_size = max(guesses.size(), (size_t)1); // avoid division by 0
-#ifndef NDEBUG
-		std::cout << "search (" << min_threshold << ", " << max_threshold << "], tot: " << guesses.size() << std::endl;
-#endif
-		// calculate new threshold
-		max_threshold = min_threshold;
-		min_threshold = min_threshold / max(2.0, 1.5 * cnt / guesses_size);
+	if (cnt == 0) return vector<StrProb>();
+	vector<StrProb> guesses = generate_by_threshold(strict_threshold(cnt, strict)); // non-strict: a few more than cnt (at most one bucket)
+	if (strict && guesses.size() > cnt) guesses.resize((size_t)cnt);
+	return guesses;
+}
+
+template <typename Visitor>
+double BaseTrieModel::excluding_bands(const GuessFilter &filter, ull cnt, Visitor &&visit) const {
+	// a band of total guesses T drops D and keeps T - D; while too few are kept, the next band goes down
+	// to cnt + (all dropped so far) guesses in total, which is more than T, so every band is non-empty
+	ull kept = 0, dropped = 0;
+	double hi = 1.0;
+	auto filtered = [&](const string &s, double p) {
+		if (filter.contains(s)) ++dropped;
+		else {
+			++kept;
+			visit(s, p);
+		}
+	};
+	while (kept < cnt) {
+		double lo = generate_threshold(cnt + dropped);
+		if (lo >= hi) break; // the model has no more guesses
+		threshold_search(filtered, lo, hi);
+		hi = lo;
 	}
+	return hi;
+}
 
+vector<StrProb> BaseTrieModel::generate_excluding(const GuessFilter &filter, ull cnt, bool strict) const {
+	vector<StrProb> guesses;
+	if (cnt == 0) return guesses;
+	excluding_bands(filter, cnt, [&guesses](const string &s, double p) { guesses.emplace_back(s, p); });
 	sort(guesses.begin(), guesses.end(), [](const StrProb &a, const StrProb &b) { return a.second > b.second; });
-	if (strict) guesses.resize((size_t)cnt);
+	if (strict && guesses.size() > cnt) guesses.resize((size_t)cnt);
+	return guesses;
+}
 
-	min_threshold = max_threshold = 1.0; // clear threshold
-	oracle = nullptr; // clear oracle
+double BaseTrieModel::exclusion_threshold(const GuessFilter &filter, ull cnt) const {
+	if (cnt == 0) return 1.0;
+	return excluding_bands(filter, cnt, [](const string &, double) {});
+}
+
+vector<StrProb> BaseTrieModel::generate_shard(ull cnt, size_t shard, size_t num_shards) const {
+	// every shard derives the same threshold on its own (counting is deterministic), so no coordination is needed
+	vector<StrProb> guesses;
+	if (cnt == 0) return guesses;
+	threshold_search_shard([&guesses](const string &s, double p) { guesses.emplace_back(s, p); }, shard, num_shards, generate_threshold(cnt));
+	sort(guesses.begin(), guesses.end(), [](const StrProb &a, const StrProb &b) { return a.second > b.second; });
+	return guesses;
+}
+
+double BaseTrieModel::policy_mass(const PasswordPolicy &policy, size_t num_samples) {
+	size_t accepted = 0;
+	for (const auto &smp : sample_many(num_samples, ((ull)re() << 32) | re())) {
+		const string &s = smp.first;
+		PasswordPolicy::State st = policy.start();
+		bool ok = true;
+		for (size_t j = 0; j < s.size() && ok; j++) ok = policy.step(st, s[j], st);
+		if (ok && policy.accepts(st)) ++accepted;
+	}
+	return (double)accepted / std::max(num_samples, (size_t)1);
+}
+
+vector<StrProb> BaseTrieModel::generate_by_policy(const PasswordPolicy &policy, ull cnt, bool renormalize) {
+	vector<StrProb> guesses;
+	if (cnt == 0) return guesses;
+	double upper, lower = bucket_threshold(cnt, upper, policy);
+	if (lower <= 0.0) return guesses; // the policy (almost) never accepts anything
+
+	policy_search([&guesses](const string &s, double p) { guesses.emplace_back(s, p); }, policy, lower);
+	sort(guesses.begin(), guesses.end(), [](const StrProb &a, const StrProb &b) { return a.second > b.second; });
+	if (renormalize) {
+		double mass = policy_mass(policy);
+		if (mass > 0.0) for (auto &g : guesses) g.second /= mass;
+	}
 	return guesses;
 }
 
 vector<StrProb> BaseTrieModel::generate_by_montecarlo(ull cnt, size_t num_samples) {
 	// experimental feature
-	std::vector<StrProb> samples;
-	for (size_t i = 0; i < num_samples; i++) samples.push_back(sample());
+	std::vector<StrProb> samples = sample_many(num_samples, ((ull)re() << 32) | re());
 	PosEstimator estimator(samples);
 	double prob = estimator.inv_position(cnt * 1.1);
 	std::cout << "Monte Carlo threshold: " << prob << std::endl;
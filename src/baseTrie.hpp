@@ -6,22 +6,165 @@
 #pragma once
 
 #include <ctime>
+#include <cmath>
 #include <algorithm>
 #include <random>
 #include <tuple>
 #include <memory>
 #include <functional>
+#include <cassert>
+#include <climits>
+#include <stdexcept>
 //#include <thread>
 
 #include "common.hpp"
 #include "baseNode.hpp"
 #include "simpleTrie.hpp"
+#include "externalSort.hpp"
+#include "externalCount.hpp"
+#include "policy.hpp"
+#include "modelMemory.hpp"
+#include "sampleStream.hpp"
+#include "guessFilter.hpp"
+#include "guessBuffer.hpp"
+#include "modelImage.hpp"
 
 namespace smoothPwd
 {
+	struct SearchFrame { // one pending ch_search call
+		size_t idx;
+		bset v;
+		double p;
+		std::string s;
+
+		SearchFrame(size_t _idx, const bset &_v, double _p, const std::string &_s) : idx(_idx), v(_v), p(_p), s(_s) {}
+	};
+
+	typedef std::vector<Node, PageAllocator<Node> > NodeVector;
+	typedef std::vector<EdgeNode, PageAllocator<EdgeNode> > EdgeVector;
+
+	// kid lists of the two kinds of branching node record
+	inline const size_t *kid_list(const Node &nd, const size_t *) { return nd.ch.data(); }
+
+	inline size_t num_kids(const Node &nd) { return nd.ch.size(); }
+
+	inline const size_t *kid_list(const FlatNode &fn, const size_t *kid_arr) { return kid_arr + fn.kids; }
+
+	inline size_t num_kids(const FlatNode &fn) { return fn.num_kids; }
+
+	template <typename Branch>
+	struct BranchView { // a tree whose branching nodes are Branch records (Node, or FlatNode of a mapped image)
+		const Branch *nodes;
+		const size_t *kid_arr; // kid lists of FlatNodes
+		const EdgeNode *edges;
+
+		static inline bool is_edge(size_t idx) { return (idx & EDGE_BIT) != 0; }
+
+		inline const EdgeNode &edge(size_t idx) const { return edges[idx & ~EDGE_BIT]; }
+
+		inline const Branch &branch(size_t idx) const { return nodes[idx]; }
+
+		inline char c(size_t idx) const { return is_edge(idx) ? edge(idx).c : nodes[idx].c; }
+
+		inline double prob(size_t idx) const { return is_edge(idx) ? edge(idx).prob : nodes[idx].prob; }
+
+		inline const size_t *kids(const Branch &nd) const { return kid_list(nd, kid_arr); }
+
+		inline size_t find_kid(const Branch &nd, char c) const { // as Node::find_ch, for a kid that is there
+			return kids(nd)[(nd.v << (CHAR_NUM - ord(c))).count()];
+		}
+
+		inline const void *record(size_t idx) const { // what the fields of idx are read from (for prefetching)
+			return is_edge(idx) ? (const void *)&edge(idx) : (const void *)&nodes[idx];
+		}
+	};
+
+	typedef BranchView<Node> NodeView;
+	typedef BranchView<FlatNode> FlatView;
+
+	struct NodeRef { // the fields of a node, whatever its kind and storage, for the less hot walks
+		double prob, prob_end, b, pf;
+		size_t fail;
+		const size_t *kids; // sorted by char, like Node::ch
+		size_t num_kids;
+		bset v;
+
+		inline bool has_kid(char c) const { return v[ord(c)]; }
+
+		inline size_t kid(char c) const { // as Node::find_ch, for a kid that is there
+			return kids[(v << (CHAR_NUM - ord(c))).count()];
+		}
+	};
+
+	struct TreeView {
+		// a tree: branching nodes, plus edge nodes for ids with EDGE_BIT. the hot walks (ch_search, ch_tally,
+		// pwd_prob_batch) are compiled for each kind of storage and take node_view() or flat_view() instead
+		const Node *nodes;         // branching nodes of a trained tree, or
+		const FlatNode *flat;      // those of a mapped model image (nodes is then null),
+		const size_t *flat_kids;   // whose kid lists are here
+		const EdgeNode *edges;
+
+		TreeView(const NodeVector &_nodes, const EdgeVector &_edges) :
+			nodes(_nodes.data()), flat(nullptr), flat_kids(nullptr), edges(_edges.data()) {}
+
+		TreeView(const FlatNode *_flat, const size_t *_flat_kids, const EdgeNode *_edges) :
+			nodes(nullptr), flat(_flat), flat_kids(_flat_kids), edges(_edges) {}
+
+		static inline bool is_edge(size_t idx) { return (idx & EDGE_BIT) != 0; }
+
+		inline const EdgeNode &edge(size_t idx) const { return edges[idx & ~EDGE_BIT]; }
+
+		inline char c(size_t idx) const { return is_edge(idx) ? edge(idx).c : flat ? flat[idx].c : nodes[idx].c; }
+
+		inline double prob(size_t idx) const { return is_edge(idx) ? edge(idx).prob : flat ? flat[idx].prob : nodes[idx].prob; }
+
+		inline NodeView node_view() const { return NodeView{ nodes, nullptr, edges }; }
+
+		inline FlatView flat_view() const { return FlatView{ flat, flat_kids, edges }; }
+
+		inline NodeRef branch(size_t idx) const { // a branching node (no EDGE_BIT)
+			if (flat) {
+				const FlatNode &fn = flat[idx];
+				NodeRef r = { fn.prob, fn.prob_end, fn.b, fn.pf, fn.fail, flat_kids + fn.kids, fn.num_kids, fn.v };
+				return r;
+			}
+			const Node &nd = nodes[idx];
+			NodeRef r = { nd.prob, nd.prob_end, nd.b, nd.pf, nd.fail, nd.ch.data(), nd.ch.size(), nd.v };
+			return r;
+		}
+
+		inline NodeRef ref(size_t idx) const {
+			if (is_edge(idx)) {
+				const EdgeNode &en = edge(idx);
+				NodeRef r = { en.prob, en.prob_end, en.b, en.pf, en.fail, &en.next, en.next == NO_KID ? (size_t)0 : 1, bset() };
+				if (en.next != NO_KID) r.v.set(ord(c(en.next)));
+				return r;
+			}
+			return branch(idx);
+		}
+	};
+
 	class BaseTrieModel {
 	private:
-		std::unique_ptr<SimpleTrie> s_trie;
+		struct Replica {
+			NodeVector tree;
+			EdgeVector edges;
+		};
+
+		std::shared_ptr<SimpleTrie> s_trie; // counts; dropped (by this model) once the tree is built
+		ExternalNgramCounter *ext_counts;   // counts on disk instead of s_trie, while training from them
+		std::vector<std::unique_ptr<const Replica> > replicas; // replicas[k]: read-only copy of the tree on NUMA node k
+		size_t count_nodes, count_bytes; // size of the counting trie the tree was built from
+		bool want_stats;                 // profile training for stats(), see collect_stats
+		std::shared_ptr<const ModelImage> image; // the tree, if mapped (see map_image); tree and edges are empty then
+
+		// the tree the calling thread should read: its node's replica if it is bound to one
+		inline TreeView local_view() const {
+			if (image) return TreeView(image->nodes(), image->kids(), image->edges());
+			int k = thread_numa_node();
+			if (k >= 0 && (size_t)k < replicas.size() && replicas[k]) return TreeView{ replicas[k]->tree, replicas[k]->edges };
+			return TreeView{ tree, edges };
+		}
 
 		inline size_t add_node(char c, int level, ull cnt, ull cnt_end, int bucket = 4) {
 			tree.emplace_back(c, level, cnt, cnt_end, bucket);
@@ -30,39 +173,97 @@ namespace smoothPwd
 
 		void aggressive_prune();
 
-		double ch_prob(size_t pred, char c, size_t &nt) const;
+		double ch_prob(const TreeView &t, size_t pred, char c, size_t &nt) const;
 
-		void ch_search(size_t idx, std::string &s, const bset v, double p) const;
+		// t: the tree to read, local_view() of the caller resolved once per search rather than per node,
+		// as a NodeView or FlatView (search_from / tally_from pick the one it has)
+		template <typename Visitor, typename View, typename Policy>
+		void ch_search(Visitor &visit, const View &t, size_t idx, std::string &s, const bset v, double p, double min_thres, double max_thres,
+			const Policy &policy, typename Policy::State st) const;
 
-		std::tuple<char, double, size_t> sample_ch(size_t idx, const bset v, double rand_val) const;
+		template <typename Tally, typename View, typename Policy>
+		bool ch_tally(Tally &tally, const View &t, size_t idx, const bset v, double p, double min_thres, double max_thres, ull mult,
+			const Policy &policy, typename Policy::State st) const;
+
+		template <typename Visitor, typename Policy = NoPolicy>
+		void search_from(Visitor &visit, const TreeView &t, size_t idx, std::string &s, const bset v, double p, double min_thres, double max_thres,
+			const Policy &policy = Policy(), typename Policy::State st = typename Policy::State()) const {
+			if (t.flat) ch_search(visit, t.flat_view(), idx, s, v, p, min_thres, max_thres, policy, st);
+			else ch_search(visit, t.node_view(), idx, s, v, p, min_thres, max_thres, policy, st);
+		}
+
+		template <typename Tally, typename Policy = NoPolicy>
+		bool tally_from(Tally &tally, const TreeView &t, size_t idx, const bset v, double p, double min_thres, double max_thres, ull mult,
+			const Policy &policy = Policy(), typename Policy::State st = typename Policy::State()) const {
+			if (t.flat) return ch_tally(tally, t.flat_view(), idx, v, p, min_thres, max_thres, mult, policy, st);
+			return ch_tally(tally, t.node_view(), idx, v, p, min_thres, max_thres, mult, policy, st);
+		}
+
+		template <typename View>
+		void prob_batch(const View &t, const char *const *pwds, size_t n, double *probs) const; // pwd_prob_batch on one kind of view
+
+		// lower end of a narrow prob. range (lower, upper] which holds the cnt-th guess (accepted by policy)
+		template <typename Policy>
+		double bucket_threshold(ull cnt, double &upper, const Policy &policy) const;
+
+		// visit(s, p) for the top guesses the filter does not hold, until at least cnt were visited: bands of
+		// lower and lower threshold, each sized by the guesses dropped so far. returns the final threshold
+		template <typename Visitor>
+		double excluding_bands(const GuessFilter &filter, ull cnt, Visitor &&visit) const;
+
+		void expand_frame(const TreeView &t, const SearchFrame &fr, double min_thres, std::vector<SearchFrame> &out) const;
+
+		// frames cut into num_parts contiguous runs of equal weight (guesses above coarse_thres), see split_search
+		std::vector<std::vector<SearchFrame> > split_frames(std::vector<SearchFrame> frames, size_t num_parts, double min_thres, double coarse_thres) const;
+
+		std::tuple<char, double, size_t> sample_ch(const TreeView &t, size_t idx, const bset v, double rand_val) const;
+
+		template <typename Uniform>
+		StrProb sample_with(Uniform &&uniform) const; // sample() drawing its random numbers from uniform()
 
 		size_t add_from_trie(char cur_char, size_t idx, const ull prune = 0, const int level = 0);
 
+		size_t add_from_runs(const ull prune = 0); // add_from_trie on the merged counts of ext_counts
+
+		void blocked_layout(size_t idx, int height, std::vector<size_t> &order) const;
+
 	protected:
-		std::vector<Node> tree;
+		NodeVector tree;
+		EdgeVector edges; // nodes folded by compress_edges()
 		size_t root, start_idx;
-		
-		// global variables for threshold search; shall be adapted to parallel versions later
-		std::function<void(std::string &, double)> oracle;
-		double min_threshold, max_threshold;
-		
+
 		std::uniform_real_distribution<double> unif;
 		std::mt19937 re;
 
+		std::vector<PhaseMemory> phases; // memory profile of the last training (see MemoryPhase)
+
+		bool profiling() const { return want_stats || Tracer::global().enabled(); } // see collect_stats
+
 		void get_fail();
 
 		void build_trie(ull prune = 0); // wrapper for add_from_trie and get_fail :P
 
+		void traced_preprocess() {
+			{
+				TraceSpan span("preprocess");
+				preprocess();
+				span.arg("nodes", (long long)tree.size());
+			}
+			compress_edges();
+		}
+
 	public:
+		enum NodeLayout {
+			LAYOUT_BFS,     // level by level from root and start node
+			LAYOUT_HOT,     // by decreasing prob. of reaching the node, so hot paths share pages
+			LAYOUT_BLOCKED  // van Emde Boas-style: recursively, top half of the levels first, then each subtree below
+		};
+
 		const int gram_size;
 
-		BaseTrieModel(int _gram_size = MAX_GRAM_SIZE) : root(0), start_idx(0), oracle(nullptr), min_threshold(1.0), max_threshold(1.0), unif(0.0, 1.0), re((unsigned int)time(nullptr)), gram_size(_gram_size) {
+		BaseTrieModel(int _gram_size = MAX_GRAM_SIZE) : ext_counts(nullptr), count_nodes(0), count_bytes(0), want_stats(false), root(0), start_idx(0), unif(0.0, 1.0), re((unsigned int)time(nullptr)), gram_size(_gram_size) {
 			re.discard(700000); // https://codereview.stackexchange.com/questions/109260/seed-stdmt19937-from-stdrandom-device
-			s_trie = std::unique_ptr<SimpleTrie>(new SimpleTrie(gram_size));
-		}
-
-		void setOracle(const decltype(oracle)& _oracle) {
-			oracle = _oracle;
+			s_trie = std::make_shared<SimpleTrie>(gram_size);
 		}
 
 		inline void add(const char *s, ull cnt = 1) {
@@ -71,59 +272,588 @@ namespace smoothPwd
 
 		virtual void preprocess() = 0;
 
+		// fold every node with at most one kid (but root and start) into an EdgeNode, so that chains of them
+		// become compressed edges; probabilities are unchanged. train() does this after preprocess()
+		void compress_edges();
+
+		// renumber nodes (after preprocess) so that search and scoring touch fewer cache lines / pages;
+		// probabilities and outputs are unchanged. a mapped image keeps the layout it was saved with
+		void renumber(NodeLayout layout);
+
+		// move the tree to (transparent or explicit) huge pages, which cuts TLB misses in scoring and search;
+		// falls back to ordinary pages if the kind asked for is unavailable. kid lists stay on the heap.
+		// a mapped image stays in the page cache
+		void use_huge_pages(PageMode mode);
+
+		// one read-only copy of the tree per NUMA node, each allocated (first touched) by a thread on that
+		// node; threads bound with numa_bind_thread() then read their local copy. costs a tree per node.
+		// returns the number of nodes served (1: single node or mapped image, nothing replicated). call it
+		// last: training, renumber() and use_huge_pages() drop the replicas
+		size_t replicate_numa();
+
+		std::vector<int> replica_nodes() const; // NUMA nodes that have a replica (to bind threads to), ascending
+
+		// the trained tree as a model image (see modelImage.hpp), for map_image()
+		void save_image(const std::string &path) const;
+
+		// read the tree from a model image instead of training: the file is mapped, not loaded, so the model
+		// is ready at once and its pages are shared with every process mapping the same image. the model
+		// must be untrained and of the image's gram size
+		void map_image(const std::string &path);
+
 		void sanity_check();
 
-		void train(const std::vector<std::string> &data) {
+		// sizes and memory use of the model, including what its training needed per phase
+		virtual TrieStats stats() const;
+
+		// have training profile itself for stats(): memory per phase (which resets the process' peak RSS)
+		// and the size of the counting trie (a walk over all of it). also done while tracing; off by default
+		void collect_stats(bool on = true) { want_stats = on; }
+
+		// hash of the trained model (probabilities, backoff factors and shape, not node ids): the same
+		// training gives the same fingerprint, whatever the layout or replicas
+		uint64_t fingerprint() const;
+
+		void train(const std::vector<std::string> &data, CountMethod method = COUNT_TRIE) {
 			std::unordered_map<std::string, ull> counter;
 			for (const auto& s : data) {
 				counter[s]++;
 			}
-			train(counter);
+			train(counter, method);
 		}
 
 		template <typename T>
-		void train(const std::unordered_map<std::string, T> &data) {
-			for (const auto& item : data) {
-				add(item.first.c_str(), (ull)item.second);
+		void train(const std::unordered_map<std::string, T> &data, CountMethod method = COUNT_TRIE) {
+			TraceSpan span("train");
+			phases.clear();
+			{
+				MemoryPhase ph(phases, "count", profiling());
+				ph.arg("items", (long long)data.size());
+				if (method == COUNT_SORTED) {
+					std::vector<std::pair<const char *, ull> > corpus;
+					corpus.reserve(data.size());
+					for (const auto& item : data) {
+						corpus.emplace_back(item.first.c_str(), (ull)item.second);
+					}
+					s_trie->add_corpus(corpus);
+				}
+				else {
+					for (const auto& item : data) {
+						add(item.first.c_str(), (ull)item.second);
+					}
+				}
 			}
-			preprocess();
+			traced_preprocess();
 			//sanity_check();
 		}
 
+		// train from counts shared with other models (counted once at gram size >= ours; see SimpleTrie::save/load);
+		// the counts are only read, so they can be reused by any number of models afterwards
+		void train(const std::shared_ptr<SimpleTrie> &counts) {
+			if (counts->gram_size < gram_size)
+				throw std::invalid_argument("counts of gram size " + std::to_string(counts->gram_size) +
+					" cannot train a model of gram size " + std::to_string(gram_size));
+			TraceSpan span("train");
+			s_trie = counts;
+			phases.clear();
+			traced_preprocess();
+		}
+
+		// out-of-core training from counts spilled to disk (see ExternalNgramCounter): the runs are merged
+		// straight into the tree, and no SimpleTrie of the whole corpus ever exists. same model as training
+		// on the same passwords in memory; the counts can be reused by other models afterwards
+		void train(ExternalNgramCounter &counts) {
+			if (counts.gram_size < gram_size)
+				throw std::invalid_argument("counts of gram size " + std::to_string(counts.gram_size) +
+					" cannot train a model of gram size " + std::to_string(gram_size));
+			TraceSpan span("train");
+			s_trie.reset();
+			ext_counts = &counts;
+			phases.clear();
+			try {
+				traced_preprocess();
+			}
+			catch (...) {
+				ext_counts = nullptr;
+				throw;
+			}
+			ext_counts = nullptr;
+		}
+
 		double pwd_prob(const char *s) const;
 
 		double pwd_prob(const std::string& s) const {
 			return pwd_prob(s.c_str());
 		}
 
-		StrProb sample();
+		// pwd_prob of many passwords, for bulk scoring: probs[i] is pwd_prob(pwds[i]) up to rounding (the
+		// backoff factors of one char are multiplied in walk order). the passwords advance in lockstep,
+		// BATCH_LANES at a time, so their cache misses overlap; several times the throughput of a loop
+		void pwd_prob_batch(const char *const *pwds, size_t n, double *probs) const;
+
+		static const int BATCH_LANES = 16;
+
+		// pwd_prob one char at a time (see ScoringSession): the state before the first char, and the prob.
+		// of c at a state, which moves on past it. c == '\0' is the end symbol and leaves the state as is.
+		// states are node ids, so they do not survive renumber()
+		size_t score_start() const { return start_idx; }
+
+		double score_step(size_t &state, char c) const {
+			size_t nt = state;
+			double p = ch_prob(local_view(), state, c, nt);
+			if (c != '\0') state = nt;
+			return p;
+		}
+
+		StrProb sample(); // from the model's own generator, so one thread at a time
+
+		// a password drawn from the model, with its prob.; the model is only read, so any number of
+		// threads may sample at once, each from its own stream
+		StrProb sample(SampleStream &rng) const;
+
+		// n samples on num_threads threads (0: all cores); sample i is drawn from stream (seed, i), so
+		// the result only depends on n and seed -- not on the threads or on timing
+		std::vector<StrProb> sample_many(size_t n, ull seed, size_t num_threads = 0) const;
 
 		//StrProb sample_brute();
 
-		void threshold_search(double min_thres, double max_thres = 1.0) {
+		// visit(s, p) is called for every guess s with probability p in (min_thres, max_thres];
+		// the model is left untouched, so several searches may run on one model at once
+		template <typename Visitor>
+		void threshold_search(Visitor &&visit, double min_thres, double max_thres = 1.0) const {
+			std::string s;
+			search_from(visit, local_view(), start_idx, s, empty_bset, 1.0, min_thres, max_thres); // the real search part
+		}
+
+		// the search tree cut into num_shards disjoint lists of frames, balanced by guess count. the split is
+		// deterministic, so every process computes the same one; it holds for any min. threshold >= min_thres
+		std::vector<std::vector<SearchFrame> > split_search(size_t num_shards, double min_thres) const;
+
+		std::vector<SearchFrame> shard_frames(size_t shard, size_t num_shards, double min_thres) const {
+			return split_search(num_shards, min_thres)[shard];
+		}
+
+		// the frames of one shard (as shard_frames) cut further into num_parts balanced runs, say one per thread
+		std::vector<std::vector<SearchFrame> > split_shard(size_t shard, size_t num_shards, size_t num_parts, double min_thres) const;
+
+		class SearchIterator;
+
+		// threshold_search as a pull-based iterator over an explicit stack (see SearchIterator)
+		SearchIterator search_iterator(double min_thres, double max_thres = 1.0) const;
+
+		// threshold_search started from the given frames only
+		template <typename Visitor>
+		void search_frames(Visitor &&visit, const std::vector<SearchFrame> &frames, double min_thres, double max_thres = 1.0) const {
+			const TreeView t = local_view();
+			for (const auto &fr : frames) {
+				std::string s(fr.s);
+				search_from(visit, t, fr.idx, s, fr.v, fr.p, min_thres, max_thres);
+			}
+		}
+
+		// threshold_search restricted to one shard; the union over all shards is threshold_search
+		template <typename Visitor>
+		void threshold_search_shard(Visitor &&visit, size_t shard, size_t num_shards, double min_thres, double max_thres = 1.0) const {
+			search_frames(visit, shard_frames(shard, num_shards, min_thres), min_thres, max_thres);
+		}
+
+		// count-only variant of threshold_search: tally(p, mult) is called for every (mult) guess(es)
+		// with probability p in (min_thres, max_thres]; no string is built. returns false if tally asked to stop
+		template <typename Tally>
+		bool threshold_tally(Tally &&tally, double min_thres, double max_thres = 1.0) const {
+			return tally_from(tally, local_view(), start_idx, empty_bset, 1.0, min_thres, max_thres, 1);
+		}
+
+		// number of guesses threshold_search would emit; gives up as soon as `limit` is reached
+		ull count_by_threshold(double min_thres, double max_thres = 1.0, ull limit = ULLONG_MAX) const;
+
+		// largest threshold t such that at least cnt guesses have probability > t
+		double find_threshold(ull cnt) const;
+
+		// threshold_search / threshold_tally within a policy (see policy.hpp): the policy automaton runs in
+		// lockstep with the search, so branches that can no longer be accepted are cut off right away
+		template <typename Visitor, typename Policy>
+		void policy_search(Visitor &&visit, const Policy &policy, double min_thres, double max_thres = 1.0) const {
 			std::string s;
-			min_threshold = min_thres; max_threshold = max_thres; // set global threshold
-			ch_search(start_idx, s, empty_bset, 1.0); // the real search part
-			min_threshold = max_threshold = 1.0; // clear threshold
+			search_from(visit, local_view(), start_idx, s, empty_bset, 1.0, min_thres, max_thres, policy, policy.start());
+		}
+
+		template <typename Tally, typename Policy>
+		bool policy_tally(Tally &&tally, const Policy &policy, double min_thres, double max_thres = 1.0) const {
+			return tally_from(tally, local_view(), start_idx, empty_bset, 1.0, min_thres, max_thres, 1, policy, policy.start());
+		}
+
+		// prob. mass of the guesses a policy accepts (Monte Carlo estimate)
+		double policy_mass(const PasswordPolicy &policy, size_t num_samples = 100000);
+
+		// the top cnt guesses accepted by the policy; with renormalize, probabilities are conditioned on the
+		// policy (divided by its estimated mass) instead of raw model probabilities
+		std::vector<StrProb> generate_by_policy(const PasswordPolicy &policy, ull cnt, bool renormalize = false);
+
+		// the (slightly lower, cheaper to find) threshold generate(cnt) searches with
+		double generate_threshold(ull cnt) const {
+			double upper;
+			return cnt == 0 ? 1.0 : bucket_threshold(cnt, upper, NoPolicy());
+		}
+
+		// strict generation cuts to cnt guesses anyway, so it searches no further than find_threshold (one
+		// more counting pass, but up to a bucket fewer guesses built and sorted); non-strict keeps the
+		// bucket boundary, which is also what shards and checkpoints agree on
+		double strict_threshold(ull cnt, bool strict) const {
+			return strict ? find_threshold(cnt) : generate_threshold(cnt);
 		}
 
 		// some wrappers below
 
-		std::vector<StrProb> generate_by_threshold(double min_thres, double max_thres = 1.0) {
+		std::vector<StrProb> generate_by_threshold(double min_thres, double max_thres = 1.0) const {
 			std::vector<StrProb> guesses;
-			oracle = [&guesses](std::string &s, double p) { guesses.emplace_back(s, p); };
-			threshold_search(min_thres, max_thres);
-			oracle = nullptr;
+			threshold_search([&guesses](const std::string &s, double p) { guesses.emplace_back(s, p); }, min_thres, max_thres);
 			std::sort(guesses.begin(), guesses.end(), [](const StrProb &a, const StrProb &b) { return a.second > b.second; });
 			return guesses;   // hopefully the compiler would perform a move operation here
 		}
 
-		std::vector<StrProb> generate(ull cnt, bool strict = false);
+		std::vector<StrProb> generate(ull cnt, bool strict = false) const;
+
+		// generate_by_threshold / generate into a GuessBuffer: a fraction of the memory per guess, and a
+		// parallel radix sort (0 threads: all cores) instead of std::sort on strings
+		GuessBuffer generate_compact_by_threshold(double min_thres, double max_thres = 1.0, size_t num_threads = 0) const {
+			GuessBuffer guesses;
+			threshold_search([&guesses](const std::string &s, double p) { guesses.add(s, p); }, min_thres, max_thres);
+			guesses.sort(num_threads);
+			return guesses;
+		}
+
+		GuessBuffer generate_compact(ull cnt, bool strict = false, size_t num_threads = 0) const {
+			if (cnt == 0) return GuessBuffer();
+			GuessBuffer guesses = generate_compact_by_threshold(strict_threshold(cnt, strict), 1.0, num_threads);
+			if (strict) guesses.truncate((size_t)cnt);
+			return guesses;
+		}
+
+		// generate() without the guesses a filter holds (say, those a dictionary stage has tried): cnt guesses
+		// that are new to the filter, unless the model runs out. false positives of the filter are dropped too
+		std::vector<StrProb> generate_excluding(const GuessFilter &filter, ull cnt, bool strict = false) const;
+
+		// the threshold generate_excluding(filter, cnt) ends at: a search with it, dropping what the filter
+		// holds, gives the same guesses (for the streaming, out-of-core and sharded modes)
+		double exclusion_threshold(const GuessFilter &filter, ull cnt) const;
+
+		// out-of-core generate_by_threshold(): guesses are spilled to sorted runs in tmp_dir so that memory
+		// stays within ~mem_limit bytes, then merged; visit(s, p) gets (at most limit of) them in descending prob. order
+		template <typename Visitor>
+		void generate_by_threshold_external(Visitor &&visit, double min_thres, double max_thres, size_t mem_limit, const std::string &tmp_dir, ull limit = ULLONG_MAX) const {
+			ExternalGuessSorter sorter(tmp_dir, mem_limit);
+			threshold_search([&sorter](const std::string &s, double p) { sorter.add(s, p); }, min_thres, max_thres);
+			sorter.merge(visit, limit);
+		}
+
+		// out-of-core generate()
+		template <typename Visitor>
+		void generate_external(Visitor &&visit, ull cnt, size_t mem_limit, const std::string &tmp_dir, bool strict = false) const {
+			if (cnt == 0) return;
+			generate_by_threshold_external(visit, strict_threshold(cnt, strict), 1.0, mem_limit, tmp_dir, strict ? cnt : ULLONG_MAX);
+		}
+
+		// generate_by_threshold(min_thres, max_thres) in bands (lo, hi] of about band_size guesses, top down:
+		// visit_band(guesses, lo) gets each band sorted, so everything above lo has been visited when it
+		// returns. factor is hi / lo of the next band, adapted as bands go by (0: size the first band
+		// exactly); a job stopped after some band resumes with max_thres = lo and the factor it had then.
+		// with num_shards > 1, the bands hold the guesses of one shard (see threshold_search_shard)
+		template <typename BandVisitor>
+		void generate_bands(BandVisitor &&visit_band, double min_thres, double max_thres, double &factor, size_t band_size = (size_t)1 << 20,
+			size_t shard = 0, size_t num_shards = 1) const {
+			band_size = std::max(band_size, (size_t)1);
+			for (double hi = max_thres; hi > min_thres;) {
+				double lo = factor == 0 ? generate_threshold(band_size * num_shards) : hi / factor;
+				lo = std::max(lo, min_thres);
+				std::vector<StrProb> guesses;
+				if (num_shards > 1) {
+					threshold_search_shard([&guesses](const std::string &s, double p) { guesses.emplace_back(s, p); }, shard, num_shards, lo, hi);
+					std::sort(guesses.begin(), guesses.end(), [](const StrProb &a, const StrProb &b) { return a.second > b.second; });
+				}
+				else guesses = generate_by_threshold(lo, hi);
+				// a band holds about log(factor) * (guesses per unit of log prob.), which changes slowly
+				double ratio = std::min(std::max((double)band_size / (double)std::max(guesses.size(), (size_t)1), 0.25), 4.0);
+				factor = factor == 0 ? 2.0 : std::max(1.0 + 1e-6, std::exp(std::log(factor) * ratio));
+				visit_band(guesses, lo);
+				hi = lo;
+			}
+		}
+
+		// shard `shard` of generate(cnt) (non-strict), for splitting one job across processes
+		std::vector<StrProb> generate_shard(ull cnt, size_t shard, size_t num_shards) const;
 
 		std::vector<StrProb> generate_by_montecarlo(ull cnt, size_t num_samples = 10000);
 
 	};
 
+	class BaseTrieModel::SearchIterator {
+		// threshold_search without recursion: the pending calls are frames on a heap-allocated stack, so
+		// guesses come out in the same order, but when the caller asks for them (next_batch), and the search
+		// can be put aside, looked at (pending) or carried over elsewhere (as frames for search_frames or a
+		// new iterator). the model must outlive it and must not be renumbered meanwhile
+	private:
+		struct Frame {
+			size_t idx;
+			bset v;
+			double p;
+			size_t len; // prefix: the first len chars of s (for every frame on the stack, they are still there)
+			int c;      // then char c (>= 0), or nothing (NO_CHAR); a starting frame has seeds[FROM_SEED - c] instead
+		};
+		static const int NO_CHAR = -1, FROM_SEED = -2;
+
+		const BaseTrieModel *model;
+		double min_thres, max_thres;
+		std::vector<Frame> stack;
+		std::vector<std::string> seeds; // strings of the starting frames
+		std::string s;                  // prefix of the frame being expanded
+
+		bool expand(const TreeView &t, const Frame &fr, StrProb &out); // one ch_search call, minus the recursion; true if it emitted
+
+	public:
+		SearchIterator(const BaseTrieModel &_model, const std::vector<SearchFrame> &frames, double _min_thres, double _max_thres = 1.0);
+
+		// the next (at most) n guesses into out[0, n); returns how many, 0 once the search is over.
+		// strings of out are assigned to, so a reused buffer keeps its allocations
+		size_t next_batch(StrProb *out, size_t n);
+
+		bool done() const { return stack.empty(); }
+
+		size_t depth() const { return stack.size(); } // frames on the stack
+
+		std::vector<SearchFrame> pending() const; // what is left, in the order it would be searched
+	};
+
+	template <typename Visitor, typename View, typename Policy>
+	void BaseTrieModel::ch_search(Visitor &visit, const View &t, size_t idx, std::string &s, const bset v, double p, double min_thres, double max_thres,
+		const Policy &policy, typename Policy::State st) const {
+		if (TreeView::is_edge(idx)) { // inside a compressed edge: the same steps, with one kid at most and never root
+			const EdgeNode &en = t.edge(idx);
+			if (p * en.pf <= PRUNE_EPS * min_thres) return; // pruned
+			if (!v[end_ord]) { // end symbol
+				double ch_p = p * en.prob_end;
+				if (ch_p > min_thres && ch_p <= max_thres && policy.accepts(st))
+					visit(s, ch_p);
+			}
+			bset fail_v = v;
+			fail_v.set(end_ord);
+			if (en.next != NO_KID) {
+				char c = t.c(en.next);
+				typename Policy::State nt;
+				if (!v[ord(c)]) {
+					double ch_p = p * t.prob(en.next);
+					if (ch_p > min_thres && policy.step(st, c, nt)) {
+						s.push_back(c);
+						ch_search(visit, t, en.next, s, empty_bset, ch_p, min_thres, max_thres, policy, nt);
+						s.pop_back();
+					}
+				}
+				fail_v.set(ord(c));
+			}
+			double fail_p = p * en.b;
+			if (fail_p <= min_thres || fail_v.all())
+				return;
+			ch_search(visit, t, en.fail, s, fail_v, fail_p, min_thres, max_thres, policy, st);
+			return;
+		}
+
+		const auto &nd = t.branch(idx);
+		if (p * nd.pf <= PRUNE_EPS * min_thres) return; // pruned
+
+		if (!v[end_ord]) { // end symbol
+			double ch_p = p * nd.prob_end;
+			if (ch_p > min_thres && ch_p <= max_thres && policy.accepts(st)) // (min_thres, max_thres]
+				visit(s, ch_p);
+		}
+
+		typename Policy::State nt;
+		const size_t *kids = t.kids(nd);
+		for (size_t k = 0, num = num_kids(nd); k < num; k++) {
+			size_t ch_idx = kids[k];
+			char c = t.c(ch_idx);
+			if (v[ord(c)])
+				continue; // banned
+			else {
+				double ch_p = p * t.prob(ch_idx);
+				if (ch_p <= min_thres || !policy.step(st, c, nt))
+					continue; // pruned
+				s.push_back(c);
+				ch_search(visit, t, ch_idx, s, empty_bset, ch_p, min_thres, max_thres, policy, nt);
+				s.pop_back();
+			}
+		}
+
+		double fail_p = p * nd.b;
+		if (fail_p <= min_thres)
+			return; // not much prob. left
+
+		bset fail_v = v | (nd.v);
+		fail_v.set(end_ord);
+
+		if (fail_v.all())
+			return; // no need to fail
+
+		if (idx == root) {
+			assert(fail_v[end_ord]); // \0 is always banned
+
+			fail_p = fail_p * nd.prob;
+			if (fail_p <= min_thres)
+				return;
+
+			for (int i = 0; i < CHAR_NUM; i++) {
+				if (fail_v[i])
+					continue;
+				char c = chr(i);
+				if (!policy.step(st, c, nt))
+					continue;
+				s.push_back(c);
+				ch_search(visit, t, root, s, empty_bset, fail_p, min_thres, max_thres, policy, nt);
+				s.pop_back();
+			}
+		}
+		else {
+			ch_search(visit, t, nd.fail, s, fail_v, fail_p, min_thres, max_thres, policy, st);
+		}
+	}
+
+	template <typename Tally, typename View, typename Policy>
+	bool BaseTrieModel::ch_tally(Tally &tally, const View &t, size_t idx, const bset v, double p, double min_thres, double max_thres, ull mult,
+		const Policy &policy, typename Policy::State st) const {
+		// mirrors ch_search without building strings; returns false once tally asks to stop
+		if (TreeView::is_edge(idx)) { // see ch_search
+			const EdgeNode &en = t.edge(idx);
+			if (p * en.pf <= PRUNE_EPS * min_thres) return true; // pruned
+			if (!v[end_ord]) { // end symbol
+				double ch_p = p * en.prob_end;
+				if (ch_p > min_thres && ch_p <= max_thres && policy.accepts(st) && !tally(ch_p, mult))
+					return false;
+			}
+			bset fail_v = v;
+			fail_v.set(end_ord);
+			if (en.next != NO_KID) {
+				char c = t.c(en.next);
+				typename Policy::State nt;
+				if (!v[ord(c)]) {
+					double ch_p = p * t.prob(en.next);
+					if (ch_p > min_thres && policy.step(st, c, nt) && !ch_tally(tally, t, en.next, empty_bset, ch_p, min_thres, max_thres, mult, policy, nt))
+						return false;
+				}
+				fail_v.set(ord(c));
+			}
+			double fail_p = p * en.b;
+			if (fail_p <= min_thres || fail_v.all())
+				return true;
+			return ch_tally(tally, t, en.fail, fail_v, fail_p, min_thres, max_thres, mult, policy, st);
+		}
+		const auto &nd = t.branch(idx);
+		if (p * nd.pf <= PRUNE_EPS * min_thres) return true; // pruned
+
+		if (!v[end_ord]) { // end symbol
+			double ch_p = p * nd.prob_end;
+			if (ch_p > min_thres && ch_p <= max_thres && policy.accepts(st) && !tally(ch_p, mult))
+				return false;
+		}
+
+		typename Policy::State nt;
+		const size_t *kids = t.kids(nd);
+		for (size_t k = 0, num = num_kids(nd); k < num; k++) {
+			size_t ch_idx = kids[k];
+			char c = t.c(ch_idx);
+			if (v[ord(c)])
+				continue; // banned
+			double ch_p = p * t.prob(ch_idx);
+			if (ch_p <= min_thres || !policy.step(st, c, nt))
+				continue; // pruned
+			if (!ch_tally(tally, t, ch_idx, empty_bset, ch_p, min_thres, max_thres, mult, policy, nt))
+				return false;
+		}
+
+		double fail_p = p * nd.b;
+		if (fail_p <= min_thres)
+			return true;
+
+		bset fail_v = v | (nd.v);
+		fail_v.set(end_ord);
+
+		if (fail_v.all())
+			return true;
+
+		if (idx == root) {
+			fail_p = fail_p * nd.prob;
+			if (fail_p <= min_thres)
+				return true;
+			// unbanned chars that lead to the same policy state lead to the very same subtree; walk it once
+			std::pair<typename Policy::State, ull> groups[CHAR_NUM];
+			size_t num_groups = 0;
+			for (int i = 0; i < CHAR_NUM; i++) {
+				if (fail_v[i] || !policy.step(st, chr(i), nt))
+					continue;
+				size_t j = 0;
+				while (j < num_groups && !(groups[j].first == nt)) ++j;
+				if (j == num_groups) groups[num_groups++] = std::make_pair(nt, (ull)0);
+				groups[j].second++;
+			}
+			for (size_t j = 0; j < num_groups; j++) {
+				if (!ch_tally(tally, t, root, empty_bset, fail_p, min_thres, max_thres, mult * groups[j].second, policy, groups[j].first))
+					return false;
+			}
+			return true;
+		}
+		else {
+			return ch_tally(tally, t, nd.fail, fail_v, fail_p, min_thres, max_thres, mult, policy, st);
+		}
+	}
+
+	template <typename Policy>
+	double BaseTrieModel::bucket_threshold(ull cnt, double &upper, const Policy &policy) const {
+		// histogram of (lo, 1] over log-scaled buckets. fewer than cnt guesses can have prob. > 1/cnt,
+		// so start from there and extrapolate (counts roughly follow a power law) until we have enough
+		const int num_bins = 1 << 16;
+		const ull budget = cnt > ULLONG_MAX / 4 ? ULLONG_MAX : cnt * 4; // don't overshoot too badly
+		double lo = std::min(1.0 / cnt, 0.5), last_lo = 1.0, scale = 0.0;
+		std::vector<ull> bins(num_bins);
+
+		while (true) {
+			scale = -num_bins / log(lo);
+			std::fill(bins.begin(), bins.end(), 0);
+			ull tot = 0;
+			const double log_lo = log(lo);
+			bool done = policy_tally([&bins, &tot, log_lo, scale, budget](double p, ull mult) {
+				bins[std::min(num_bins - 1, (int)((log(p) - log_lo) * scale))] += mult;
+				tot = mult >= budget - tot ? budget : tot + mult;
+				return tot < budget;
+			}, policy, lo);
+
+			if (!done) { // went way too far; step back halfway
+				lo = sqrt(lo * last_lo);
+				continue;
+			}
+			if (tot >= cnt) break;
+
+			// fit c(t) ~ t^-alpha on c(lo) and c(4 lo)
+			ull upper_cnt = 0;
+			for (int i = std::min(num_bins, (int)ceil(log(4.0) * scale)); i < num_bins; i++) upper_cnt += bins[i];
+			double alpha = (upper_cnt > 0 && upper_cnt < tot) ? log((double)tot / upper_cnt) / log(4.0) : 1.0;
+			double next_lo = lo * pow((double)std::max(tot, (ull)1) / cnt, 1.0 / alpha) / 1.2;
+			last_lo = lo;
+			lo = std::min(std::max(next_lo, lo / 16), lo / 1.25);
+			if (lo == 0.0) { // the model cannot produce that many guesses
+				upper = 0.0;
+				return 0.0;
+			}
+		}
+
+		// find the bucket holding the cnt-th guess
+		ull need = cnt;
+		int target = num_bins - 1;
+		while (bins[target] < need) {
+			need -= bins[target];
+			--target;
+		}
+		upper = exp(log(lo) + (target + 1) / scale) * (1.0 + 1e-6);
+		return std::max(lo, exp(log(lo) + target / scale) * (1.0 - 1e-6));
+	}
+
 	class PosEstimator {
 		// ref: Dell'Amico and Filippone, "Monte Carlo Strength Evaluation:
 		// Fast and Reliable Password Checking," CCS'15. https://github.com/matteodellamico/montecarlopwd
@@ -0,0 +1,65 @@
+/*
+ * checkpoint.cpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#include "checkpoint.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+
+#include <unistd.h>
+
+using smoothPwd::GenerationCheckpoint;
+using std::string;
+
+namespace
+{
+	const char checkpoint_magic[8] = { 'S', 'P', 'W', 'D', 'C', 'K', 'P', '2' };
+}
+
+void GenerationCheckpoint::save(const string &path) const {
+	// [magic][guess_num][thres][format][shard][#shards][model][filter][hi][factor][emitted][offset]
+	string tmp = path + ".tmp";
+	FILE *f = fopen(tmp.c_str(), "wb");
+	if (f == nullptr) throw std::runtime_error("cannot create " + tmp);
+	int32_t fmt = format;
+	fwrite(checkpoint_magic, 1, sizeof(checkpoint_magic), f);
+	fwrite(&guess_num, sizeof(guess_num), 1, f);
+	fwrite(&thres, sizeof(thres), 1, f);
+	fwrite(&fmt, sizeof(fmt), 1, f);
+	fwrite(&shard, sizeof(shard), 1, f);
+	fwrite(&num_shards, sizeof(num_shards), 1, f);
+	fwrite(&model, sizeof(model), 1, f);
+	fwrite(&filter, sizeof(filter), 1, f);
+	fwrite(&hi, sizeof(hi), 1, f);
+	fwrite(&factor, sizeof(factor), 1, f);
+	fwrite(&emitted, sizeof(emitted), 1, f);
+	fwrite(&offset, sizeof(offset), 1, f);
+	bool ok = fflush(f) == 0 && fsync(fileno(f)) == 0 && ferror(f) == 0;
+	ok = (fclose(f) == 0) && ok;
+	if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+		throw std::runtime_error("cannot write " + path);
+}
+
+bool GenerationCheckpoint::load(const string &path, GenerationCheckpoint &ckpt) {
+	FILE *f = fopen(path.c_str(), "rb");
+	if (f == nullptr) return false;
+	std::unique_ptr<FILE, int (*)(FILE *)> guard(f, fclose);
+
+	char magic[sizeof(checkpoint_magic)];
+	int32_t fmt;
+	if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, checkpoint_magic, sizeof(magic)) != 0)
+		throw std::runtime_error(path + " is not a generation checkpoint");
+	if (fread(&ckpt.guess_num, sizeof(ckpt.guess_num), 1, f) != 1 || fread(&ckpt.thres, sizeof(ckpt.thres), 1, f) != 1 ||
+		fread(&fmt, sizeof(fmt), 1, f) != 1 || fread(&ckpt.shard, sizeof(ckpt.shard), 1, f) != 1 ||
+		fread(&ckpt.num_shards, sizeof(ckpt.num_shards), 1, f) != 1 || fread(&ckpt.model, sizeof(ckpt.model), 1, f) != 1 ||
+		fread(&ckpt.filter, sizeof(ckpt.filter), 1, f) != 1 || fread(&ckpt.hi, sizeof(ckpt.hi), 1, f) != 1 ||
+		fread(&ckpt.factor, sizeof(ckpt.factor), 1, f) != 1 || fread(&ckpt.emitted, sizeof(ckpt.emitted), 1, f) != 1 ||
+		fread(&ckpt.offset, sizeof(ckpt.offset), 1, f) != 1)
+		throw std::runtime_error("truncated generation checkpoint");
+	ckpt.format = fmt;
+	return true;
+}
@@ -0,0 +1,41 @@
+/*
+ * checkpoint.hpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "common.hpp"
+
+namespace smoothPwd
+{
+	struct GenerationCheckpoint {
+		// where a banded generation job (see BaseTrieModel::generate_bands) stands: every guess with prob.
+		// above hi is in the output, which is offset bytes long. saved after each band, so a preempted job
+		// cuts its output back to offset and carries on from hi, without duplicated or skipped guesses
+		ull guess_num = 0;  // the job: a checkpoint is only taken up by a run with the same guess_num,
+		double thres = 0;   // final threshold,
+		int format = 0;     // GuessWriter::Format of the output,
+		ull shard = 0, num_shards = 1;
+		uint64_t model = 0; // BaseTrieModel::fingerprint()
+		uint64_t filter = 0; // GuessFilter::fingerprint() of --exclude (0: none)
+		double hi = 1.0;    // next band starts here
+		double factor = 0;  // its hi / lo
+		ull emitted = 0;    // guesses in the output
+		ull offset = 0;     // bytes in the output
+
+		bool same_job(const GenerationCheckpoint &other) const {
+			return guess_num == other.guess_num && thres == other.thres && format == other.format &&
+				shard == other.shard && num_shards == other.num_shards && model == other.model && filter == other.filter;
+		}
+
+		// written to path + ".tmp" and renamed over path, so a crash mid-save keeps the previous checkpoint
+		void save(const std::string &path) const;
+
+		// false if there is no checkpoint at path; throws if the file is not one
+		static bool load(const std::string &path, GenerationCheckpoint &ckpt);
+	};
+} // namespace smoothPwd
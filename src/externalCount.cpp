@@ -0,0 +1,145 @@
+/*
+ * externalCount.cpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#include "externalCount.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+
+using smoothPwd::NgramRunReader;
+using smoothPwd::ExternalNgramCounter;
+using smoothPwd::ull;
+using std::string;
+using std::vector;
+
+namespace
+{
+	class NgramRunWriter { // front-codes sorted records into a run file
+	private:
+		FILE *f;
+		string path, prev;
+		vector<char> buf;
+
+	public:
+		NgramRunWriter(const string &_path, size_t buf_size) : f(fopen(_path.c_str(), "wb")), path(_path), buf(std::max(buf_size, (size_t)4096)) {
+			if (f == nullptr)
+				throw std::runtime_error("cannot create run file " + path);
+			setvbuf(f, buf.data(), _IOFBF, buf.size());
+		}
+
+		~NgramRunWriter() {
+			if (f != nullptr) fclose(f);
+		}
+
+		void put(const string &key, ull cnt, ull cnt_end) {
+			size_t shared = 0, m = std::min(key.size(), prev.size());
+			while (shared < m && key[shared] == prev[shared]) ++shared;
+			uint16_t head[2] = { (uint16_t)shared, (uint16_t)(key.size() - shared) };
+			fwrite(head, sizeof(head), 1, f);
+			fwrite(key.data() + shared, 1, head[1], f);
+			fwrite(&cnt, sizeof(cnt), 1, f);
+			fwrite(&cnt_end, sizeof(cnt_end), 1, f);
+			prev = key;
+		}
+
+		void close() {
+			bool ok = ferror(f) == 0;
+			ok = (fclose(f) == 0) && ok;
+			f = nullptr;
+			if (!ok)
+				throw std::runtime_error("cannot write run file " + path);
+		}
+	};
+}
+
+NgramRunReader::NgramRunReader(const string &_path, size_t buf_size) : path(_path), f(fopen(_path.c_str(), "rb")), buf(std::max(buf_size, (size_t)4096)), pos(0), len(0), cnt(0), cnt_end(0) {
+	if (f == nullptr)
+		throw std::runtime_error("cannot open run file " + path);
+}
+
+NgramRunReader::~NgramRunReader() {
+	fclose(f);
+}
+
+bool NgramRunReader::at_end() {
+	if (pos == len) {
+		len = fread(buf.data(), 1, buf.size(), f);
+		pos = 0;
+		if (len == 0 && ferror(f))
+			throw std::runtime_error("cannot read run file " + path);
+	}
+	return len == 0;
+}
+
+void NgramRunReader::fill(char *dst, size_t n) {
+	while (n > 0) {
+		if (at_end())
+			throw std::runtime_error("truncated run file " + path);
+		size_t m = std::min(n, len - pos);
+		memcpy(dst, &buf[pos], m);
+		pos += m;
+		dst += m;
+		n -= m;
+	}
+}
+
+bool NgramRunReader::next() {
+	uint16_t head[2];
+	if (at_end()) return false;
+	fill(reinterpret_cast<char *>(head), sizeof(head));
+	key.resize(head[0] + head[1]);
+	if (head[1] > 0) fill(&key[head[0]], head[1]);
+	fill(reinterpret_cast<char *>(&cnt), sizeof(cnt));
+	fill(reinterpret_cast<char *>(&cnt_end), sizeof(cnt_end));
+	return true;
+}
+
+ExternalNgramCounter::ExternalNgramCounter(const string &_tmp_dir, size_t _mem_limit, int _gram_size) :
+	tmp_dir(_tmp_dir), mem_limit(std::max(_mem_limit, (size_t)1 << 20)), bytes_per_char(64.0), run_id(0),
+	tag(std::random_device()()), num_added(0), gram_size(_gram_size) {
+}
+
+ExternalNgramCounter::~ExternalNgramCounter() {
+	for (const auto &path : runs) remove(path.c_str());
+}
+
+string ExternalNgramCounter::run_path() {
+	return tmp_dir + "/smoothpwd_" + std::to_string(tag) + "_" + std::to_string(run_id++) + ".ngrams";
+}
+
+size_t ExternalNgramCounter::fan_in() const {
+	// each reader gets a buffer of >= 1 MiB (plus one for the writer in intermediate passes)
+	return std::max((size_t)2, mem_limit / ((size_t)1 << 20) - 1);
+}
+
+void ExternalNgramCounter::spill() {
+	if (items.empty()) return;
+	TraceSpan span("spill");
+	span.arg("items", (long long)items.size());
+	string path = run_path();
+	NgramRunWriter out(path, (size_t)1 << 20);
+	TrieStats st = count_chunk([&out](const string &key, ull cnt, ull cnt_end) { out.put(key, cnt, cnt_end); });
+	out.close();
+	runs.push_back(path);
+
+	// the next chunk is sized by this one's trie; its vector grows by doubling, hence the margin
+	bytes_per_char = std::max(4.0, 1.5 * (double)st.tree_bytes / (double)text.size() + 4.0);
+	text.clear();
+	items.clear();
+}
+
+void ExternalNgramCounter::merge_pass(size_t first, size_t last, size_t buf_size) {
+	// merge runs[first, last) into a single new run at the back
+	string path = run_path();
+	NgramRunWriter out(path, buf_size);
+	merge_runs(first, last, buf_size, [&out](const string &key, ull cnt, ull cnt_end) { out.put(key, cnt, cnt_end); });
+	out.close();
+
+	for (size_t i = first; i < last; i++) remove(runs[i].c_str());
+	runs.erase(runs.begin() + first, runs.begin() + last);
+	runs.push_back(path);
+}
@@ -0,0 +1,191 @@
+/*
+ * externalCount.hpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+
+#include <vector>
+#include <string>
+#include <queue>
+#include <memory>
+
+#include "common.hpp"
+#include "simpleTrie.hpp"
+
+namespace smoothPwd
+{
+	// an n-gram's key is its path from root, the start symbol written as START_KEY (above all printables):
+	// keys in sorted order are a pre-order walk of the count trie, kids in ord() order
+	const char START_KEY = '\x7f';
+
+	class NgramRunReader { // sequential reader of one sorted run: [uint16 shared][uint16 rest][rest chars][cnt][cnt_end]
+	private:
+		const std::string path;
+		FILE *f;
+		std::vector<char> buf;
+		size_t pos, len;
+
+		bool at_end(); // no bytes left (refills the buffer)
+
+		void fill(char *dst, size_t n); // throws if the run ends first: a record cut short
+
+	public:
+		std::string key; // front-coded: the first `shared` chars are the previous key's
+		ull cnt, cnt_end;
+
+		NgramRunReader(const std::string &path, size_t buf_size);
+
+		~NgramRunReader();
+
+		bool next(); // load the next record into (key, cnt, cnt_end); false at the end of the run, throws if it ends mid-record
+	};
+
+	class ExternalNgramCounter {
+		// counts the n-grams of an unbounded stream of passwords in ~mem_limit bytes: passwords are collected
+		// into a chunk, each full chunk is counted (SimpleTrie::add_corpus) and spilled to tmp_dir as a run of
+		// (key, cnt, cnt_end) in key order, and runs are k-way merged with counts added up. the counts stay
+		// until destruction, so any number of models (gram size <= gram_size) can be trained from them
+	private:
+		const std::string tmp_dir;
+		const size_t mem_limit;
+		std::vector<char> text;                         // the current chunk, '\0'-terminated passwords
+		std::vector<std::pair<size_t, ull> > items;     // (offset in text, count) of the current chunk
+		double bytes_per_char;                          // count trie bytes per text byte, learnt from spilled chunks
+		std::vector<std::string> runs;
+		unsigned int run_id;
+		const unsigned int tag;
+		ull num_added;
+
+		std::string run_path();
+
+		void spill();
+
+		void merge_pass(size_t first, size_t last, size_t buf_size);
+
+		size_t fan_in() const;
+
+		// visit(key, cnt, cnt_end) for every n-gram of the current chunk with cnt > 0, in key order
+		template <typename Visitor>
+		TrieStats count_chunk(Visitor &&visit) const;
+
+		// visit(key, cnt, cnt_end) for every n-gram of runs[first, last), in key order, counts added up
+		template <typename Visitor>
+		void merge_runs(size_t first, size_t last, size_t buf_size, Visitor &&visit) const;
+
+	public:
+		const int gram_size;
+
+		ExternalNgramCounter(const std::string &_tmp_dir, size_t _mem_limit, int _gram_size = MAX_GRAM_SIZE);
+
+		~ExternalNgramCounter();
+
+		ExternalNgramCounter(const ExternalNgramCounter &) = delete;
+
+		inline void add(const char *s, ull cnt = 1) {
+			size_t l = strlen(s);
+			if ((double)(text.size() + l + 1) * (1.0 + bytes_per_char) + (items.size() + 1) * sizeof(items[0]) > (double)mem_limit)
+				spill();
+			items.emplace_back(text.size(), cnt);
+			text.insert(text.end(), s, s + l + 1);
+			num_added++;
+		}
+
+		ull size() const { return num_added; } // passwords added
+
+		size_t num_runs() const { return runs.size(); }
+
+		// visit(key, cnt, cnt_end) for every n-gram of everything added, in key order (see START_KEY);
+		// cnt and cnt_end as in the SimpleTrie of all passwords. without spilled runs no disk is involved
+		template <typename Visitor>
+		void merge(Visitor &&visit);
+	};
+
+	template <typename Visitor>
+	TrieStats ExternalNgramCounter::count_chunk(Visitor &&visit) const {
+		std::vector<std::pair<const char *, ull> > corpus;
+		corpus.reserve(items.size());
+		for (const auto &item : items) corpus.emplace_back(&text[item.first], item.second);
+		SimpleTrie trie(gram_size);
+		trie.add_corpus(corpus);
+
+		// pre-order walk, kids in ord() order (the start node is root's last kid); tails are spelt out
+		struct Frame {
+			size_t idx, depth; // node, and the length of its key
+			char c;            // last char of its key
+		};
+		std::string key;
+		std::vector<Frame> stk(1, Frame{ trie.root, 0, '\0' });
+		while (!stk.empty()) {
+			Frame fr = stk.back();
+			stk.pop_back();
+			const SimpleNode &nd = trie.tree[fr.idx];
+			if (nd.cnt == 0) continue; // unused level 1 node
+			key.resize(fr.depth);
+			if (fr.depth > 0) key[fr.depth - 1] = fr.c;
+
+			if (nd.s != nullptr) { // a chain of nodes with nd's counts, cnt_end at its end
+				const char *tail = nd.s;
+				while (*tail == '\0') ++tail;
+				visit(key, nd.cnt, (ull)0);
+				for (; *tail != '\0'; tail++) {
+					key.push_back(*tail);
+					visit(key, nd.cnt, tail[1] == '\0' ? nd.cnt_end : (ull)0);
+				}
+				continue;
+			}
+			visit(key, nd.cnt, nd.cnt_end);
+			size_t ith = nd.ch.size();
+			for (int i = CHAR_NUM - 1; i >= 0; i--) { // reversed, so that they are popped in order
+				if (nd.v[i]) stk.push_back(Frame{ nd.ch[--ith], fr.depth + 1, i == end_ord ? START_KEY : chr(i) });
+			}
+		}
+		return trie.stats();
+	}
+
+	template <typename Visitor>
+	void ExternalNgramCounter::merge_runs(size_t first, size_t last, size_t buf_size, Visitor &&visit) const {
+		std::vector<std::unique_ptr<NgramRunReader> > readers;
+		auto cmp = [&readers](size_t a, size_t b) { return readers[a]->key > readers[b]->key; };
+		std::priority_queue<size_t, std::vector<size_t>, decltype(cmp)> Q(cmp);
+		for (size_t i = first; i < last; i++) {
+			readers.emplace_back(new NgramRunReader(runs[i], buf_size));
+			if (readers.back()->next()) Q.push(readers.size() - 1);
+		}
+		std::string key;
+		while (!Q.empty()) {
+			size_t i = Q.top();
+			Q.pop();
+			key = readers[i]->key;
+			ull cnt = readers[i]->cnt, cnt_end = readers[i]->cnt_end;
+			if (readers[i]->next()) Q.push(i);
+			while (!Q.empty() && readers[Q.top()]->key == key) { // the same n-gram from other runs
+				size_t j = Q.top();
+				Q.pop();
+				cnt += readers[j]->cnt;
+				cnt_end += readers[j]->cnt_end;
+				if (readers[j]->next()) Q.push(j);
+			}
+			visit(key, cnt, cnt_end);
+		}
+	}
+
+	template <typename Visitor>
+	void ExternalNgramCounter::merge(Visitor &&visit) {
+		if (runs.empty()) { // everything fit in memory
+			count_chunk(visit);
+			return;
+		}
+		spill();
+		std::vector<char>().swap(text); // the merge buffers take over the memory budget
+		std::vector<std::pair<size_t, ull> >().swap(items);
+		size_t k = fan_in();
+		while (runs.size() > k) { // merge the oldest runs into one, until a single pass is enough
+			merge_pass(0, k, mem_limit / (k + 1));
+		}
+		merge_runs(0, runs.size(), mem_limit / runs.size(), visit);
+	}
+} // namespace smoothPwd
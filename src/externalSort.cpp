@@ -0,0 +1,154 @@
+/*
+ * externalSort.cpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#include "externalSort.hpp"
+
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+
+using smoothPwd::GuessRunReader;
+using smoothPwd::ExternalGuessSorter;
+using std::string;
+using std::vector;
+using std::pair;
+
+GuessRunReader::GuessRunReader(const string &_path, size_t buf_size) : path(_path), f(fopen(_path.c_str(), "rb")), buf(std::max(buf_size, (size_t)4096)), pos(0), len(0), p(0.0) {
+	if (f == nullptr)
+		throw std::runtime_error("cannot open run file " + path);
+}
+
+GuessRunReader::~GuessRunReader() {
+	fclose(f);
+}
+
+bool GuessRunReader::at_end() {
+	if (pos == len) {
+		len = fread(buf.data(), 1, buf.size(), f);
+		pos = 0;
+		if (len == 0 && ferror(f))
+			throw std::runtime_error("cannot read run file " + path);
+	}
+	return len == 0;
+}
+
+void GuessRunReader::fill(char *dst, size_t n) {
+	while (n > 0) {
+		if (at_end())
+			throw std::runtime_error("truncated run file " + path);
+		size_t m = std::min(n, len - pos);
+		memcpy(dst, &buf[pos], m);
+		pos += m;
+		dst += m;
+		n -= m;
+	}
+}
+
+bool GuessRunReader::next() {
+	uint16_t l;
+	if (at_end()) return false;
+	fill(reinterpret_cast<char *>(&p), sizeof(p));
+	fill(reinterpret_cast<char *>(&l), sizeof(l));
+	s.resize(l);
+	if (l > 0) fill(&s[0], l);
+	return true;
+}
+
+ExternalGuessSorter::ExternalGuessSorter(const string &_tmp_dir, size_t _mem_limit) :
+	tmp_dir(_tmp_dir), mem_limit(std::max(_mem_limit, (size_t)1 << 20)), run_id(0), tag(std::random_device()()) {
+	// half of the budget for packed strings, half for the (prob, offset) index
+	max_records = mem_limit / 2 / sizeof(pair<double, size_t>);
+	arena.reserve(mem_limit / 2);
+	index.reserve(max_records);
+}
+
+ExternalGuessSorter::~ExternalGuessSorter() {
+	for (const auto &path : runs) remove(path.c_str());
+}
+
+string ExternalGuessSorter::run_path() {
+	return tmp_dir + "/smoothpwd_" + std::to_string(tag) + "_" + std::to_string(run_id++) + ".run";
+}
+
+size_t ExternalGuessSorter::fan_in() const {
+	// each reader gets a buffer of >= 1 MiB (plus one for the writer in intermediate passes)
+	return std::max((size_t)2, mem_limit / ((size_t)1 << 20) - 1);
+}
+
+void ExternalGuessSorter::sort_run() {
+	std::sort(index.begin(), index.end(), [](const pair<double, size_t> &a, const pair<double, size_t> &b) { return a.first > b.first; });
+}
+
+void ExternalGuessSorter::spill() {
+	if (index.empty()) return;
+	sort_run();
+
+	string path = run_path();
+	FILE *f = fopen(path.c_str(), "wb");
+	if (f == nullptr)
+		throw std::runtime_error("cannot create run file " + path);
+
+	// the arena is written out in sorted order through a bounded staging buffer
+	vector<char> out;
+	out.reserve((size_t)1 << 20);
+	for (const auto &item : index) {
+		uint16_t l;
+		memcpy(&l, &arena[item.second], sizeof(l));
+		if (out.size() + sizeof(double) + sizeof(l) + l > out.capacity()) {
+			fwrite(out.data(), 1, out.size(), f);
+			out.clear();
+		}
+		const char *pp = reinterpret_cast<const char *>(&item.first);
+		out.insert(out.end(), pp, pp + sizeof(double));
+		out.insert(out.end(), &arena[item.second], &arena[item.second] + sizeof(l) + l);
+	}
+	fwrite(out.data(), 1, out.size(), f);
+	bool ok = ferror(f) == 0;
+	fclose(f);
+	if (!ok)
+		throw std::runtime_error("cannot write run file " + path);
+
+	runs.push_back(path);
+	index.clear();
+	arena.clear();
+}
+
+void ExternalGuessSorter::merge_pass(size_t first, size_t last, size_t buf_size) {
+	// merge runs[first, last) into a single new run at the back
+	vector<std::unique_ptr<GuessRunReader> > readers;
+	auto cmp = [&readers](size_t a, size_t b) { return readers[a]->p < readers[b]->p; };
+	std::priority_queue<size_t, vector<size_t>, decltype(cmp)> Q(cmp);
+	for (size_t i = first; i < last; i++) {
+		readers.emplace_back(new GuessRunReader(runs[i], buf_size));
+		if (readers.back()->next()) Q.push(readers.size() - 1);
+	}
+
+	string path = run_path();
+	FILE *f = fopen(path.c_str(), "wb");
+	if (f == nullptr)
+		throw std::runtime_error("cannot create run file " + path);
+	vector<char> wbuf(std::max(buf_size, (size_t)4096));
+	setvbuf(f, wbuf.data(), _IOFBF, wbuf.size());
+
+	while (!Q.empty()) {
+		size_t i = Q.top();
+		Q.pop();
+		const GuessRunReader &r = *readers[i];
+		uint16_t l = (uint16_t)r.s.size();
+		fwrite(&r.p, sizeof(r.p), 1, f);
+		fwrite(&l, sizeof(l), 1, f);
+		fwrite(r.s.data(), 1, l, f);
+		if (readers[i]->next()) Q.push(i);
+	}
+	bool ok = ferror(f) == 0;
+	fclose(f);
+	if (!ok)
+		throw std::runtime_error("cannot write run file " + path);
+
+	readers.clear();
+	for (size_t i = first; i < last; i++) remove(runs[i].c_str());
+	runs.erase(runs.begin() + first, runs.begin() + last);
+	runs.push_back(path);
+}
@@ -0,0 +1,135 @@
+/*
+ * externalSort.hpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <climits>
+
+#include <vector>
+#include <string>
+#include <queue>
+#include <memory>
+
+#include "common.hpp"
+
+namespace smoothPwd
+{
+	class GuessRunReader { // sequential reader of one sorted run: records of [double p][uint16 len][len chars]
+	private:
+		const std::string path;
+		FILE *f;
+		std::vector<char> buf;
+		size_t pos, len;
+
+		bool at_end(); // no bytes left (refills the buffer)
+
+		void fill(char *dst, size_t n); // throws if the run ends first: a record cut short
+
+	public:
+		std::string s;
+		double p;
+
+		GuessRunReader(const std::string &path, size_t buf_size);
+
+		~GuessRunReader();
+
+		bool next(); // load the next record into (s, p); false at the end of the run, throws if it ends mid-record
+	};
+
+	class ExternalGuessSorter {
+		// sorts an unbounded stream of guesses by prob. (descending) in ~mem_limit bytes:
+		// guesses are packed into a fixed-size in-memory run, each full run is sorted and spilled
+		// to tmp_dir, and runs are k-way merged at the end (in several passes if there are too many)
+	private:
+		const std::string tmp_dir;
+		const size_t mem_limit;
+		std::vector<char> arena;                        // packed [uint16 len][len chars] of the current run
+		std::vector<std::pair<double, size_t> > index;  // (prob, offset in arena) of the current run
+		size_t max_records;
+		std::vector<std::string> runs;
+		unsigned int run_id;
+		const unsigned int tag;
+
+		std::string run_path();
+
+		void sort_run();
+
+		void spill();
+
+		void merge_pass(size_t first, size_t last, size_t buf_size);
+
+		size_t fan_in() const;
+
+	public:
+		ExternalGuessSorter(const std::string &_tmp_dir, size_t _mem_limit);
+
+		~ExternalGuessSorter();
+
+		inline void add(const std::string &s, double p) {
+			uint16_t l = (uint16_t)s.size();
+			if (index.size() >= max_records || arena.size() + sizeof(l) + l > arena.capacity())
+				spill();
+			index.emplace_back(p, arena.size());
+			const char *lp = reinterpret_cast<const char *>(&l);
+			arena.insert(arena.end(), lp, lp + sizeof(l));
+			arena.insert(arena.end(), s.begin(), s.end());
+		}
+
+		size_t num_runs() const { return runs.size(); }
+
+		// visit(s, p) for (at most limit) guesses in descending prob. order; the sorter is emptied
+		template <typename Visitor>
+		void merge(Visitor &&visit, ull limit = ULLONG_MAX);
+	};
+
+	template <typename Visitor>
+	void ExternalGuessSorter::merge(Visitor &&visit, ull limit) {
+		ull cnt = 0;
+		if (runs.empty()) { // everything fit in memory; no disk involved
+			sort_run();
+			std::string s;
+			for (size_t i = 0; i < index.size() && cnt < limit; i++, cnt++) {
+				uint16_t l;
+				memcpy(&l, &arena[index[i].second], sizeof(l));
+				s.assign(&arena[index[i].second + sizeof(l)], l);
+				visit(s, index[i].first);
+			}
+			index.clear();
+			arena.clear();
+			return;
+		}
+
+		spill();
+		std::vector<char>().swap(arena); // the merge buffers take over the memory budget
+		std::vector<std::pair<double, size_t> >().swap(index);
+		size_t k = fan_in();
+		while (runs.size() > k) { // merge the oldest runs into one, until a single pass is enough
+			merge_pass(0, k, mem_limit / (k + 1));
+		}
+
+		size_t buf_size = mem_limit / runs.size();
+		std::vector<std::unique_ptr<GuessRunReader> > readers;
+		auto cmp = [&readers](size_t a, size_t b) { return readers[a]->p < readers[b]->p; };
+		std::priority_queue<size_t, std::vector<size_t>, decltype(cmp)> Q(cmp);
+		for (size_t i = 0; i < runs.size(); i++) {
+			readers.emplace_back(new GuessRunReader(runs[i], buf_size));
+			if (readers[i]->next()) Q.push(i);
+		}
+		while (!Q.empty() && cnt < limit) {
+			size_t i = Q.top();
+			Q.pop();
+			visit(readers[i]->s, readers[i]->p);
+			++cnt;
+			if (readers[i]->next()) Q.push(i);
+		}
+		readers.clear();
+		for (const auto &path : runs) remove(path.c_str());
+		runs.clear();
+		arena.reserve(mem_limit / 2);
+		index.reserve(max_records);
+	}
+} // namespace smoothPwd
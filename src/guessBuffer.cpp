@@ -0,0 +1,75 @@
+/*
+ * guessBuffer.cpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#include "guessBuffer.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <thread>
+
+using smoothPwd::GuessBuffer;
+using std::vector;
+
+void GuessBuffer::sort(size_t num_threads) {
+	// LSD radix sort, 16-bit digits: probabilities are >= 0, so their bits order like the values and
+	// ~bits ascending is prob. descending. a pass is a count and a scatter, both split over the threads,
+	// each thread scattering its own slice from its own offsets (which keeps the sort stable). passes
+	// whose digit is the same for every record (say, the exponent of a narrow band) are skipped
+	const int DIGIT_BITS = 16;
+	const size_t BUCKETS = (size_t)1 << DIGIT_BITS;
+	size_t n = recs.size();
+	if (n < 2) return;
+	if (num_threads == 0) num_threads = std::max(1u, std::thread::hardware_concurrency());
+	num_threads = std::max((size_t)1, std::min(num_threads, n / BUCKETS)); // a slice should outweigh its histogram
+
+	auto key = [](const Record &r) {
+		uint64_t bits;
+		memcpy(&bits, &r.p, sizeof(bits));
+		return ~bits;
+	};
+	auto parallel = [num_threads](const std::function<void(size_t)> &work) {
+		vector<std::thread> workers;
+		for (size_t t = 1; t < num_threads; t++) workers.emplace_back(work, t);
+		work(0);
+		for (auto &w : workers) w.join();
+	};
+
+	vector<Record> tmp(n);
+	Record *src = recs.data(), *dst = tmp.data();
+	vector<vector<size_t> > hist(num_threads, vector<size_t>(BUCKETS));
+	for (int shift = 0; shift < 64; shift += DIGIT_BITS) {
+		parallel([&](size_t t) {
+			vector<size_t> &h = hist[t];
+			std::fill(h.begin(), h.end(), 0);
+			for (size_t i = n * t / num_threads; i < n * (t + 1) / num_threads; i++) h[(key(src[i]) >> shift) & (BUCKETS - 1)]++;
+		});
+
+		bool trivial = false;
+		for (size_t d = 0; d < BUCKETS; d++) {
+			size_t tot = 0;
+			for (size_t t = 0; t < num_threads; t++) tot += hist[t][d];
+			if (tot > 0) {
+				trivial = tot == n;
+				break;
+			}
+		}
+		if (trivial) continue;
+
+		size_t sum = 0; // hist[t][d] becomes where slice t puts its first record with digit d
+		for (size_t d = 0; d < BUCKETS; d++) {
+			for (size_t t = 0; t < num_threads; t++) {
+				size_t c = hist[t][d];
+				hist[t][d] = sum;
+				sum += c;
+			}
+		}
+		parallel([&](size_t t) {
+			vector<size_t> &h = hist[t];
+			for (size_t i = n * t / num_threads; i < n * (t + 1) / num_threads; i++) dst[h[(key(src[i]) >> shift) & (BUCKETS - 1)]++] = src[i];
+		});
+		std::swap(src, dst);
+	}
+	if (src == tmp.data()) recs.swap(tmp);
+}
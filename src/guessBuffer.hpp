@@ -0,0 +1,82 @@
+/*
+ * guessBuffer.hpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include <vector>
+#include <string>
+
+#include "common.hpp"
+
+namespace smoothPwd
+{
+	class GuessBuffer {
+		// guesses packed for bulk generation: the chars of all of them back to back in one arena, plus a
+		// 16-byte (prob., offset, length) record each, instead of a std::string (32 bytes, a heap block past
+		// 15 chars) and a double per guess. sorted by an LSD radix sort on the prob. bits, in parallel
+	private:
+		struct Record {
+			double p;
+			uint64_t ref; // offset << 16 | length
+		};
+
+		std::vector<char> arena;
+		std::vector<Record> recs;
+
+	public:
+		void reserve(size_t guesses, size_t chars) {
+			recs.reserve(guesses);
+			arena.reserve(chars);
+		}
+
+		void add(const char *s, size_t len, double p) {
+			recs.push_back(Record{ p, (uint64_t)arena.size() << 16 | (uint64_t)len });
+			arena.insert(arena.end(), s, s + len);
+		}
+
+		void add(const std::string &s, double p) { add(s.data(), s.size(), p); }
+
+		size_t size() const { return recs.size(); }
+
+		bool empty() const { return recs.empty(); }
+
+		const char *data(size_t i) const { return arena.data() + (recs[i].ref >> 16); }
+
+		size_t length(size_t i) const { return (size_t)(recs[i].ref & 0xFFFF); }
+
+		std::string str(size_t i) const { return std::string(data(i), length(i)); }
+
+		double prob(size_t i) const { return recs[i].p; }
+
+		size_t bytes() const { return arena.capacity() + recs.capacity() * sizeof(Record); }
+
+		void truncate(size_t n) { // keeps the first n records; their chars stay in the arena
+			if (n < recs.size()) recs.resize(n);
+		}
+
+		// descending prob., ties in insertion order. 0 threads: all cores
+		void sort(size_t num_threads = 0);
+
+		// visit(s, p) in order, through one reused string (a GuessWriter::Producer takes it as is)
+		template <typename Visitor>
+		void for_each(Visitor &&visit) const {
+			std::string s;
+			for (size_t i = 0; i < recs.size(); i++) {
+				s.assign(data(i), length(i));
+				visit(s, recs[i].p);
+			}
+		}
+
+		std::vector<StrProb> to_vector() const {
+			std::vector<StrProb> guesses;
+			guesses.reserve(recs.size());
+			for (size_t i = 0; i < recs.size(); i++) guesses.emplace_back(str(i), recs[i].p);
+			return guesses;
+		}
+	};
+} // namespace smoothPwd
@@ -0,0 +1,156 @@
+/*
+ * guessFilter.cpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#include "guessFilter.hpp"
+
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+
+using smoothPwd::GuessFilter;
+using smoothPwd::ull;
+using std::string;
+
+namespace
+{
+	const char filter_magic[8] = { 'S', 'P', 'W', 'D', 'B', 'L', 'M', '2' }; // 2: blocks picked by block_of
+	const int max_k = 16;
+
+	inline uint64_t fmix64(uint64_t x) { // MurmurHash3 finalizer
+		x ^= x >> 33;
+		x *= 0xff51afd7ed558ccdULL;
+		x ^= x >> 33;
+		x *= 0xc4ceb9fe1a85ec53ULL;
+		x ^= x >> 33;
+		return x;
+	}
+
+	// the block of a key: from a second mix of its hash, so that it is independent of the bits probed
+	// inside the block (which use h itself), then multiply-shift onto [0, num_blocks) (modulo beyond 2^32 blocks)
+	inline size_t block_of(uint64_t h, size_t num_blocks) {
+		uint64_t x = fmix64(h ^ 0x5851F42D4C957F2DULL);
+		return ((uint64_t)num_blocks >> 32) != 0 ? (size_t)(x % num_blocks) : (size_t)((x >> 32) * num_blocks >> 32);
+	}
+}
+
+uint64_t GuessFilter::hash(const char *s, size_t len) {
+	uint64_t h = 0x9E3779B97F4A7C15ULL * (len + 1);
+	size_t i = 0;
+	for (; i + 8 <= len; i += 8) {
+		uint64_t w;
+		memcpy(&w, s + i, sizeof(w));
+		h = fmix64(h ^ w) + 0x9E3779B97F4A7C15ULL;
+	}
+	uint64_t w = 0;
+	for (size_t j = 0; i < len; i++, j += 8) w |= (uint64_t)(unsigned char)s[i] << j;
+	return fmix64(h ^ w);
+}
+
+GuessFilter::GuessFilter(ull expected, double bits_per_entry) : num_added(0) {
+	bits_per_entry = std::max(bits_per_entry, 1.0);
+	double total = std::max((double)expected, 1.0) * bits_per_entry;
+	num_blocks = (size_t)std::ceil(total / (BLOCK_WORDS * 64));
+	bits.assign(num_blocks * BLOCK_WORDS, 0);
+	k = std::min(max_k, std::max(1, (int)std::lround(bits_per_entry * 0.6931)));
+}
+
+void GuessFilter::add(const char *s, size_t len) {
+	uint64_t h = hash(s, len);
+	uint64_t *block = &bits[block_of(h, num_blocks) * BLOCK_WORDS];
+	uint32_t h1 = (uint32_t)(h >> 32), h2 = (uint32_t)h | 1;
+	for (int i = 0; i < k; i++) {
+		uint32_t b = (h1 + (uint32_t)i * h2) & 511;
+		block[b >> 6] |= (uint64_t)1 << (b & 63);
+	}
+	num_added++;
+}
+
+bool GuessFilter::contains(const char *s, size_t len) const {
+	uint64_t h = hash(s, len);
+	const uint64_t *block = &bits[block_of(h, num_blocks) * BLOCK_WORDS];
+	uint32_t h1 = (uint32_t)(h >> 32), h2 = (uint32_t)h | 1;
+	for (int i = 0; i < k; i++) {
+		uint32_t b = (h1 + (uint32_t)i * h2) & 511;
+		if (!(block[b >> 6] >> (b & 63) & 1)) return false;
+	}
+	return true;
+}
+
+GuessFilter GuessFilter::from_wordlist(const string &path, double bits_per_entry) {
+	ull lines = 0;
+	string line;
+	{
+		std::ifstream fin(path);
+		if (!fin) throw std::runtime_error("cannot open " + path);
+		while (std::getline(fin, line)) ++lines;
+	}
+	GuessFilter filter(lines, bits_per_entry);
+	std::ifstream fin(path);
+	while (std::getline(fin, line)) filter.add(line);
+	return filter;
+}
+
+uint64_t GuessFilter::fingerprint() const {
+	uint64_t h = hash(reinterpret_cast<const char *>(bits.data()), bytes());
+	return fmix64(h ^ ((uint64_t)k << 56 ^ num_added));
+}
+
+void GuessFilter::save(const string &path) const {
+	// [magic][k][#blocks][#added][bits]
+	FILE *f = fopen(path.c_str(), "wb");
+	if (f == nullptr) throw std::runtime_error("cannot create " + path);
+	int32_t kk = k;
+	uint64_t nb = num_blocks, na = num_added;
+	fwrite(filter_magic, 1, sizeof(filter_magic), f);
+	fwrite(&kk, sizeof(kk), 1, f);
+	fwrite(&nb, sizeof(nb), 1, f);
+	fwrite(&na, sizeof(na), 1, f);
+	fwrite(bits.data(), sizeof(uint64_t), bits.size(), f);
+	bool ok = ferror(f) == 0;
+	ok = (fclose(f) == 0) && ok;
+	if (!ok) throw std::runtime_error("cannot write " + path);
+}
+
+GuessFilter GuessFilter::load(const string &path) {
+	FILE *f = fopen(path.c_str(), "rb");
+	if (f == nullptr) throw std::runtime_error("cannot open " + path);
+	std::unique_ptr<FILE, int (*)(FILE *)> guard(f, fclose);
+
+	char magic[sizeof(filter_magic)];
+	int32_t kk;
+	uint64_t nb, na;
+	if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, filter_magic, sizeof(magic)) != 0)
+		throw std::runtime_error(path + " is not a guess filter");
+	if (fread(&kk, sizeof(kk), 1, f) != 1 || fread(&nb, sizeof(nb), 1, f) != 1 || fread(&na, sizeof(na), 1, f) != 1)
+		throw std::runtime_error("truncated guess filter");
+	// checked before anything is allocated: the blocks must all be in the file
+	long head = ftell(f);
+	if (head < 0 || fseek(f, 0, SEEK_END) != 0) throw std::runtime_error("cannot read " + path);
+	uint64_t body = (uint64_t)(ftell(f) - head);
+	if (fseek(f, head, SEEK_SET) != 0) throw std::runtime_error("cannot read " + path);
+	if (kk < 1 || kk > max_k || nb == 0 || nb > body / (BLOCK_WORDS * sizeof(uint64_t)))
+		throw std::runtime_error("corrupt guess filter " + path);
+
+	GuessFilter filter;
+	filter.k = kk;
+	filter.num_blocks = (size_t)nb;
+	filter.num_added = na;
+	filter.bits.assign(filter.num_blocks * BLOCK_WORDS, 0);
+	if (fread(filter.bits.data(), sizeof(uint64_t), filter.bits.size(), f) != filter.bits.size())
+		throw std::runtime_error("truncated guess filter");
+	return filter;
+}
+
+bool GuessFilter::is_saved(const string &path) {
+	FILE *f = fopen(path.c_str(), "rb");
+	if (f == nullptr) return false;
+	char magic[sizeof(filter_magic)];
+	bool ok = fread(magic, 1, sizeof(magic), f) == sizeof(magic) && memcmp(magic, filter_magic, sizeof(magic)) == 0;
+	fclose(f);
+	return ok;
+}
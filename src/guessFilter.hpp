@@ -0,0 +1,59 @@
+/*
+ * guessFilter.hpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include <vector>
+#include <string>
+
+#include "common.hpp"
+
+namespace smoothPwd
+{
+	class GuessFilter {
+		// set of already-tried guesses to leave out of generation (see BaseTrieModel::generate_excluding).
+		// blocked Bloom filter (Putze et al., "Cache-, hash-, and space-efficient Bloom filters", WEA'07):
+		// a key sets / tests k bits of one 512-bit block, so a lookup is one cache miss. no false negatives;
+		// ~1% false positives at 10 bits per entry (a dropped guess that was new), ~0.2% at 16
+	private:
+		static const size_t BLOCK_WORDS = 8; // 512 bits
+		std::vector<uint64_t> bits;
+		size_t num_blocks;
+		int k;
+		ull num_added;
+
+	public:
+		static uint64_t hash(const char *s, size_t len); // 64-bit string hash (also keys GuessRankIndex)
+
+		GuessFilter(ull expected = 0, double bits_per_entry = 10.0);
+
+		void add(const char *s, size_t len);
+
+		void add(const std::string &s) { add(s.data(), s.size()); }
+
+		bool contains(const char *s, size_t len) const;
+
+		bool contains(const std::string &s) const { return contains(s.data(), s.size()); }
+
+		ull size() const { return num_added; }
+
+		size_t bytes() const { return bits.size() * sizeof(uint64_t); }
+
+		uint64_t fingerprint() const; // hash of the contents: equal filters, equal fingerprints
+
+		// every line of a wordlist (read twice: once to size the filter, once to fill it)
+		static GuessFilter from_wordlist(const std::string &path, double bits_per_entry = 10.0);
+
+		// built filters can be kept next to the wordlist and reloaded in one read
+		void save(const std::string &path) const;
+
+		static GuessFilter load(const std::string &path);
+
+		static bool is_saved(const std::string &path); // whether path starts like a saved filter (else: a wordlist, say)
+	};
+} // namespace smoothPwd
@@ -0,0 +1,73 @@
+/*
+ * guessWriter.cpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#include "guessWriter.hpp"
+
+using smoothPwd::GuessWriter;
+using std::vector;
+
+GuessWriter::GuessWriter(FILE *_out, Format _format, size_t _chunk_size, size_t queue_chunks) :
+	format(_format), out(_out), chunk_size(_chunk_size), full(queue_chunks), empty(queue_chunks),
+	failed(false), handed(0), queued(0), written(0) {
+	for (size_t i = 0; i < queue_chunks; i++) {
+		pool.emplace_back(new vector<char>());
+		pool.back()->reserve(chunk_size);
+		empty.push(pool.back().get());
+	}
+	writer = std::thread(&GuessWriter::run, this);
+}
+
+vector<char> *GuessWriter::get_chunk() {
+	vector<char> *chunk = nullptr;
+	empty.pop(chunk); // waits while every chunk is queued or being written; empty is never closed
+	return chunk;
+}
+
+void GuessWriter::put_chunk(vector<char> *chunk) {
+	{
+		std::lock_guard<std::mutex> lock(sync_mu);
+		++queued;
+	}
+	full.push(chunk);
+}
+
+void GuessWriter::Producer::flush() {
+	if (chunk == nullptr) return;
+	w.handed += cnt;
+	cnt = 0;
+	w.put_chunk(chunk); // empty chunks are fine; the writer just recycles them
+	chunk = nullptr;
+}
+
+void GuessWriter::run() {
+	vector<char> *chunk;
+	while (full.pop(chunk)) { // until finish() closes the queue and it is drained
+		if (!chunk->empty() && fwrite(chunk->data(), 1, chunk->size(), out) != chunk->size())
+			failed = true; // keep draining so that producers never block forever
+		chunk->clear();
+		empty.push(chunk);
+		{
+			std::lock_guard<std::mutex> lock(sync_mu);
+			++written;
+		}
+		drained.notify_all();
+	}
+	if (fflush(out) != 0) failed = true;
+}
+
+bool GuessWriter::sync() {
+	{
+		std::unique_lock<std::mutex> lock(sync_mu);
+		drained.wait(lock, [this]() { return written == queued; });
+	}
+	if (fflush(out) != 0) failed = true; // the writer thread is idle until the next chunk comes
+	return ok();
+}
+
+void GuessWriter::finish() {
+	if (!writer.joinable()) return;
+	full.close();
+	writer.join();
+}
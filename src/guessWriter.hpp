@@ -0,0 +1,155 @@
+/*
+ * guessWriter.hpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+
+#include <vector>
+#include <string>
+#include <deque>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+
+#include "common.hpp"
+
+namespace smoothPwd
+{
+	template <typename T>
+	class BoundedQueue {
+		// bounded MPMC queue; a full queue blocks push(), an empty one blocks pop(), so neither side
+		// burns a core waiting. a handful of 1 MiB chunks go through it, so a lock costs nothing here
+	private:
+		std::deque<T> items;
+		const size_t capacity;
+		bool closed;
+		std::mutex mu;
+		std::condition_variable not_empty, not_full;
+
+	public:
+		BoundedQueue(size_t _capacity) : capacity(_capacity), closed(false) {}
+
+		// blocks while the queue is full; this is where producers feel backpressure
+		void push(const T &x) {
+			std::unique_lock<std::mutex> lock(mu);
+			not_full.wait(lock, [this]() { return items.size() < capacity; });
+			items.push_back(x);
+			lock.unlock();
+			not_empty.notify_one();
+		}
+
+		// blocks while the queue is empty and open; false once it is closed and drained
+		bool pop(T &x) {
+			std::unique_lock<std::mutex> lock(mu);
+			not_empty.wait(lock, [this]() { return !items.empty() || closed; });
+			if (items.empty()) return false;
+			x = items.front();
+			items.pop_front();
+			lock.unlock();
+			not_full.notify_one();
+			return true;
+		}
+
+		void close() { // pop() returns false once the rest is taken
+			{
+				std::lock_guard<std::mutex> lock(mu);
+				closed = true;
+			}
+			not_empty.notify_all();
+		}
+	};
+
+	class GuessWriter {
+		// producer/consumer output stage: search threads fill chunks through their own Producer,
+		// full chunks go through a bounded queue to one writer thread doing large fwrite()s.
+		// a fixed pool of chunks bounds memory; when the sink is slow, producers block.
+	public:
+		enum Format {
+			TEXT,   // "guess\n"
+			BINARY  // [uint16 len][len chars][double prob], native byte order
+		};
+
+		class Producer {
+		private:
+			GuessWriter &w;
+			std::vector<char> *chunk;
+			ull cnt;
+
+		public:
+			Producer(GuessWriter &_w) : w(_w), chunk(w.get_chunk()), cnt(0) {}
+
+			Producer(const Producer &) = delete;
+
+			Producer(Producer &&other) : w(other.w), chunk(other.chunk), cnt(other.cnt) {
+				other.chunk = nullptr;
+				other.cnt = 0;
+			}
+
+			~Producer() { flush(); }
+
+			inline void operator()(const std::string &s, double p) {
+				size_t need = s.size() + (w.format == TEXT ? 1 : sizeof(uint16_t) + sizeof(double));
+				if (chunk->size() + need > chunk->capacity()) {
+					w.put_chunk(chunk);
+					chunk = w.get_chunk();
+				}
+				if (w.format == TEXT) {
+					chunk->insert(chunk->end(), s.begin(), s.end());
+					chunk->push_back('\n');
+				}
+				else {
+					uint16_t l = (uint16_t)s.size();
+					const char *lp = reinterpret_cast<const char *>(&l), *pp = reinterpret_cast<const char *>(&p);
+					chunk->insert(chunk->end(), lp, lp + sizeof(l));
+					chunk->insert(chunk->end(), s.begin(), s.end());
+					chunk->insert(chunk->end(), pp, pp + sizeof(p));
+				}
+				++cnt;
+			}
+
+			void flush(); // hand over whatever is buffered
+		};
+
+		const Format format;
+
+		GuessWriter(FILE *_out, Format _format = TEXT, size_t _chunk_size = (size_t)1 << 20, size_t queue_chunks = 64);
+
+		~GuessWriter() { finish(); }
+
+		Producer producer() { return Producer(*this); }
+
+		void finish(); // wait until everything handed over is written; producers must be flushed first
+
+		// wait until everything handed over so far is written and flushed, then keep going (a consistent
+		// point in the output, e.g. for a checkpoint); producers must be flushed first
+		bool sync();
+
+		ull count() const { return handed.load(); } // guesses flushed by producers so far
+
+		bool ok() const { return !failed.load(); }
+
+	private:
+		FILE *out;
+		const size_t chunk_size;
+		std::vector<std::unique_ptr<std::vector<char> > > pool;
+		BoundedQueue<std::vector<char> *> full, empty;
+		std::atomic<bool> failed;
+		std::atomic<ull> handed;
+		ull queued, written;             // chunks; under sync_mu
+		std::mutex sync_mu;
+		std::condition_variable drained; // written caught up with queued
+		std::thread writer;
+
+		std::vector<char> *get_chunk();
+
+		void put_chunk(std::vector<char> *chunk);
+
+		void run(); // writer thread
+	};
+} // namespace smoothPwd
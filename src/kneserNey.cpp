@@ -20,50 +20,61 @@ using std::cout;
 using std::endl;
 
 void ModifiedKneserNeyModel::build_table(NodeTable& table) {
-	for (size_t idx = 0; idx < tree.size(); idx++) {
-		const Node& nd = tree[idx];
-		table.add_node(nd.level, nd, idx);
-	}
+	{
+		TraceSpan span("expand");
+		for (size_t idx = 0; idx < tree.size(); idx++) {
+			const Node& nd = tree[idx];
+			table.add_node(nd.level, nd, idx);
+		}
 
-	// subtree of start node
-	std::queue<size_t> Q;
-	const Node &start_nd = tree[start_idx];
-	for (int j = 2; j < gram_size; j++) table.add_node(j, start_nd, start_idx); // only n-1 start symbols
-	for (size_t ch_idx : start_nd.ch) Q.push(ch_idx);
+		// subtree of start node
+		std::queue<size_t> Q;
+		const Node &start_nd = tree[start_idx];
+		for (int j = 2; j < gram_size; j++) table.add_node(j, start_nd, start_idx); // only n-1 start symbols
+		for (size_t ch_idx : start_nd.ch) Q.push(ch_idx);
 
-	while (!Q.empty()) {
-		size_t idx = Q.front();
-		const Node &nd = tree[idx];
-		Q.pop();
+		while (!Q.empty()) {
+			size_t idx = Q.front();
+			const Node &nd = tree[idx];
+			Q.pop();
 
-		for (int j = nd.level + 1; j <= gram_size; j++) { // expand start symbol
-			table.add_node(j, nd, idx);
+			for (int j = nd.level + 1; j <= gram_size; j++) { // expand start symbol
+				table.add_node(j, nd, idx);
+			}
+			for (size_t ch_idx : nd.ch) Q.push(ch_idx);
 		}
-		for (size_t ch_idx : nd.ch) Q.push(ch_idx);
-	}
 
-	// DEBUG: see how much memory we saved (or, how little)
+		// see how much memory we saved (or, how little); a hash node is the entry plus a next pointer and cached hash
+		table_entries = table_bytes = 0;
+		for (const auto& row : table.tb) {
+			table_entries += row.size();
+			table_bytes += row.size() * (sizeof(std::pair<const size_t, InterimNode>) + 2 * sizeof(void *)) + row.bucket_count() * sizeof(void *);
+		}
 #ifndef NDEBUG
-	size_t table_size = 0;
-	for (const auto& row : table.tb) { table_size += row.size(); }
-	cout << "compressed: " << tree.size() << " expanded: " << table_size << endl;
+		cout << "compressed: " << tree.size() << " expanded: " << table_entries << endl;
 #endif
+		span.arg("entries", (long long)table_entries);
+	}
 
-	// calculate adjusted count
-	for (size_t level = 2; level < table.tb.size(); level++) {
-		auto& last_row = table.tb[level - 1];
-		const auto& cur_row = table.tb[level];
-		for (const auto& item : cur_row) {
-			size_t idx = item.first;
-			if (table.is_end_idx(idx))
-				assert(tree[table.inv_end_idx(idx)].cnt_end > 0);
-			else
-				assert(tree[idx].cnt > 0);
-
-			last_row[item.second.second].first++; // item.second = (cnt, fail) => last_row[fail].cnt++
+	{
+		TraceSpan span("adjust_counts");
+		// calculate adjusted count
+		for (size_t level = 2; level < table.tb.size(); level++) {
+			auto& last_row = table.tb[level - 1];
+			const auto& cur_row = table.tb[level];
+			for (const auto& item : cur_row) {
+				size_t idx = item.first;
+				if (table.is_end_idx(idx))
+					assert(tree[table.inv_end_idx(idx)].cnt_end > 0);
+				else
+					assert(tree[idx].cnt > 0);
+
+				last_row[item.second.second].first++; // item.second = (cnt, fail) => last_row[fail].cnt++
+			}
 		}
 	}
 
+	TraceSpan span("calc_discount");
 	table.calc_discount();
 }
 
@@ -194,7 +205,22 @@ void ModifiedKneserNeyModel::get_pf(size_t idx) {
 void ModifiedKneserNeyModel::preprocess() {
 	build_trie(0); // normally root would be 0
 	NodeTable table(gram_size, num_discount_param, tree.size(), root);
-	build_table(table);
-	get_probs(table);
+	{
+		MemoryPhase ph(phases, "build_table", profiling());
+		build_table(table);
+	}
+	{
+		MemoryPhase ph(phases, "get_probs", profiling());
+		ph.arg("nodes", (long long)tree.size());
+		get_probs(table);
+	}
+	MemoryPhase ph(phases, "get_pf", profiling());
 	get_pf(root);
 }
+
+smoothPwd::TrieStats ModifiedKneserNeyModel::stats() const {
+	TrieStats st = BaseTrieModel::stats();
+	st.table_entries = table_entries;
+	st.table_bytes = table_bytes;
+	return st;
+}
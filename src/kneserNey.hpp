@@ -67,13 +67,17 @@ namespace smoothPwd
 
 		void get_pf(size_t idx);
 
+		size_t table_entries, table_bytes; // size of the last NodeTable
+
 	public:
 		const int num_discount_param;
 
 		ModifiedKneserNeyModel(int _gram_size, int _num_discount_param = 3) :
-			BaseTrieModel(_gram_size), num_discount_param(_num_discount_param) {
+			BaseTrieModel(_gram_size), table_entries(0), table_bytes(0), num_discount_param(_num_discount_param) {
 		};
 
 		void preprocess();
+
+		TrieStats stats() const;
 	};
 } // namespace smoothPwd
@@ -0,0 +1,116 @@
+/*
+ * mergedStream.cpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#include "mergedStream.hpp"
+
+#include <cfloat>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+using smoothPwd::ModelStream;
+using smoothPwd::MergedGuessStream;
+using smoothPwd::BaseTrieModel;
+using smoothPwd::StrProb;
+using std::vector;
+
+ModelStream::ModelStream(const vector<const BaseTrieModel *> &models, const vector<double> &_weights, size_t _self, size_t _band_size) :
+	model(*models[_self]), others(models), weights(_weights), self(_self), band_size(std::max(_band_size, (size_t)1)), pos(0), found(0), hi(1.0), factor(0), pending_hi(1.0) {
+	start_band();
+}
+
+vector<StrProb> ModelStream::search_band(double lo, double hi) {
+	vector<StrProb> guesses;
+	model.threshold_search([&guesses](const std::string &s, double p) { guesses.emplace_back(s, p); }, lo, hi);
+	found = guesses.size();
+
+	// keep the guesses this model owns; probabilities are compared as pwd_prob gives them, so that every
+	// stream comes to the same decision for the same string
+	vector<const char *> pwds(guesses.size());
+	for (size_t i = 0; i < guesses.size(); i++) pwds[i] = guesses[i].first.c_str();
+	vector<double> own(guesses.size()), other(guesses.size());
+	model.pwd_prob_batch(pwds.data(), pwds.size(), own.data());
+	vector<bool> keep(guesses.size(), true);
+	for (size_t j = 0; j < others.size(); j++) {
+		if (j == self) continue;
+		others[j]->pwd_prob_batch(pwds.data(), pwds.size(), other.data());
+		for (size_t i = 0; i < guesses.size(); i++) {
+			double mine = weights[self] * own[i], theirs = weights[j] * other[i];
+			if (theirs > mine || (theirs == mine && j < self)) keep[i] = false;
+		}
+	}
+
+	size_t n = 0;
+	for (size_t i = 0; i < guesses.size(); i++)
+		if (keep[i]) {
+			guesses[n].first.swap(guesses[i].first);
+			guesses[n].second = weights[self] * guesses[i].second;
+			++n;
+		}
+	guesses.resize(n);
+	std::sort(guesses.begin(), guesses.end(), [](const StrProb &a, const StrProb &b) { return a.second > b.second; });
+	return guesses;
+}
+
+void ModelStream::start_band() {
+	double lo;
+	if (factor == 0) { // first band: its bound is cheap to find exactly
+		lo = model.generate_threshold(band_size);
+		factor = 2.0;
+	}
+	else
+		lo = hi / factor;
+	if (lo < DBL_MIN) return; // below that, probabilities underflow: the model is out of guesses
+	double band_hi = pending_hi = hi;
+	pending = std::async(std::launch::async, [this, lo, band_hi]() { return search_band(lo, band_hi); });
+	hi = lo;
+}
+
+void ModelStream::load() {
+	band = pending.get();
+	pos = 0;
+	// a band holds about log(factor) * (guesses per unit of log prob.), and the latter changes slowly:
+	// scale log(factor) by how far this band was off (counted before the owner filter thinned it out)
+	double ratio = std::min(std::max((double)band_size / (double)std::max(found, (size_t)1), 0.25), 4.0);
+	factor = std::max(1.0 + 1e-6, std::exp(std::log(factor) * ratio));
+	start_band();
+}
+
+MergedGuessStream::MergedGuessStream(const vector<const BaseTrieModel *> &models, vector<double> weights, size_t band_size) {
+	if (weights.empty()) weights.assign(models.size(), 1.0);
+	if (weights.size() != models.size())
+		throw std::invalid_argument("one weight per model");
+	for (double w : weights)
+		if (!(w > 0)) throw std::invalid_argument("model weights must be positive");
+	for (size_t i = 0; i < models.size(); i++)
+		streams.emplace_back(new ModelStream(models, weights, i, band_size));
+}
+
+bool MergedGuessStream::next(std::string &s, double &p) {
+	// k-way merge by a scan over the heads: a handful of models, and a guess costs pwd_probs anyway.
+	// a stream whose band is not in yet competes with its upper bound, and is only waited for when that
+	// bound is the highest: a model that owns few guesses is not searched further ahead than needed
+	for (;;) {
+		ModelStream *best = nullptr;
+		double top = -1.0;
+		for (auto &stream : streams) {
+			double b = stream->bound();
+			if (b > top) {
+				best = stream.get();
+				top = b;
+			}
+		}
+		if (best == nullptr) return false;
+		const StrProb *head = best->head();
+		if (head == nullptr) {
+			best->load();
+			continue;
+		}
+		s = head->first;
+		p = head->second;
+		best->pop();
+		return true;
+	}
+}
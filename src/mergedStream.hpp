@@ -0,0 +1,82 @@
+/*
+ * mergedStream.hpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#pragma once
+
+#include <climits>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+#include "baseTrie.hpp"
+
+namespace smoothPwd
+{
+	class ModelStream {
+		// the guesses of one model in descending prob. order, without an end: bands (lo, hi] of prob. are
+		// searched and sorted one after another, the next one in the background while this one is read.
+		// band bounds adapt so that a band holds about band_size guesses
+	private:
+		const BaseTrieModel &model;
+		const std::vector<const BaseTrieModel *> others; // a guess is kept only by its owner (see MergedGuessStream)
+		const std::vector<double> weights;               // of all models, this one at index self
+		const size_t self;
+		const size_t band_size;
+		std::vector<StrProb> band;
+		size_t pos, found;  // found: guesses in the last band searched, owned or not
+		double hi, factor;  // the next band is (hi / factor, hi]
+		double pending_hi;  // upper end of the band being searched
+		std::future<std::vector<StrProb> > pending;
+
+		std::vector<StrProb> search_band(double lo, double hi);
+
+		void start_band();
+
+	public:
+		ModelStream(const std::vector<const BaseTrieModel *> &models, const std::vector<double> &_weights, size_t _self, size_t _band_size);
+
+		ModelStream(const ModelStream &) = delete;
+
+		// the next guess (prob. weighted) if its band is in, nullptr otherwise
+		const StrProb *head() const { return pos < band.size() ? &band[pos] : nullptr; }
+
+		// the weighted prob. of the next guess is at most this; negative once the model has none left
+		double bound() const { return head() ? band[pos].second : pending.valid() ? weights[self] * pending_hi : -1.0; }
+
+		void pop() { ++pos; }
+
+		void load(); // waits for the band being searched (the current one must be used up)
+	};
+
+	class MergedGuessStream {
+		// several trained models as one guess stream, in descending order of weighted prob. w_i * p_i(s).
+		// a guess is emitted once, by its owner: the model with the highest w_j * p_j(s) (lowest index on ties).
+		// every model stream drops the guesses it does not own, so nothing has to be remembered, and the
+		// stream is the list of all guesses by max_j w_j * p_j(s). models must outlive the stream
+	private:
+		std::vector<std::unique_ptr<ModelStream> > streams;
+
+	public:
+		MergedGuessStream(const std::vector<const BaseTrieModel *> &models, std::vector<double> weights = std::vector<double>(),
+			size_t band_size = (size_t)1 << 16);
+
+		bool next(std::string &s, double &p); // false once no model has guesses left
+
+		// visit(s, p) for the first cnt guesses; returns how many were visited
+		template <typename Visitor>
+		ull generate(Visitor &&visit, ull cnt = ULLONG_MAX) {
+			std::string s;
+			double p;
+			ull n = 0;
+			while (n < cnt && next(s, p)) {
+				visit(s, p);
+				++n;
+			}
+			return n;
+		}
+	};
+} // namespace smoothPwd
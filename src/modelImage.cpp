@@ -0,0 +1,126 @@
+/*
+ * modelImage.cpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#include "modelImage.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using smoothPwd::ModelImage;
+using smoothPwd::FlatNode;
+using smoothPwd::EdgeNode;
+using std::string;
+
+namespace
+{
+	const char image_magic[8] = { 'S', 'P', 'W', 'D', 'I', 'M', 'G', '1' };
+
+	struct Header { // 64 bytes, so the records after it stay aligned
+		char magic[8];
+		uint32_t node_bytes, edge_bytes; // sizeof(FlatNode), sizeof(EdgeNode) of the writer
+		int32_t gram_size;
+		uint32_t reserved;
+		uint64_t root, start_idx;
+		uint64_t num_nodes, num_edges, num_kids;
+	};
+}
+
+ModelImage::~ModelImage() {
+#ifdef __linux__
+	if (map_addr != nullptr) munmap(map_addr, len);
+#endif
+}
+
+void ModelImage::save(const string &path, int gram_size, size_t root, size_t start_idx, const FlatNode *nodes, size_t num_nodes,
+	const EdgeNode *edges, size_t num_edges, const size_t *kids, size_t num_kids) {
+	// [header][nodes][edges][kids], written to path + ".tmp" and renamed over path: processes that have
+	// the old image mapped keep reading it (truncating a mapped file would crash them)
+	string tmp = path + ".tmp";
+	FILE *f = fopen(tmp.c_str(), "wb");
+	if (f == nullptr) throw std::runtime_error("cannot create " + tmp);
+	Header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, image_magic, sizeof(image_magic));
+	h.node_bytes = (uint32_t)sizeof(FlatNode);
+	h.edge_bytes = (uint32_t)sizeof(EdgeNode);
+	h.gram_size = gram_size;
+	h.root = root;
+	h.start_idx = start_idx;
+	h.num_nodes = num_nodes;
+	h.num_edges = num_edges;
+	h.num_kids = num_kids;
+	fwrite(&h, sizeof(h), 1, f);
+	fwrite(nodes, sizeof(FlatNode), num_nodes, f);
+	fwrite(edges, sizeof(EdgeNode), num_edges, f);
+	fwrite(kids, sizeof(size_t), num_kids, f);
+	bool ok = ferror(f) == 0;
+	ok = (fclose(f) == 0) && ok;
+	if (!ok || rename(tmp.c_str(), path.c_str()) != 0) throw std::runtime_error("cannot write " + path);
+}
+
+std::shared_ptr<const ModelImage> ModelImage::map(const string &path) {
+	Header h;
+	std::shared_ptr<ModelImage> image(new ModelImage());
+	{
+		FILE *f = fopen(path.c_str(), "rb");
+		if (f == nullptr) throw std::runtime_error("cannot open " + path);
+		std::unique_ptr<FILE, int (*)(FILE *)> guard(f, fclose);
+		if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, image_magic, sizeof(image_magic)) != 0)
+			throw std::runtime_error(path + " is not a model image");
+		if (h.node_bytes != sizeof(FlatNode) || h.edge_bytes != sizeof(EdgeNode))
+			throw std::runtime_error(path + " was written by an incompatible build");
+		image->len = sizeof(h) + h.num_nodes * sizeof(FlatNode) + h.num_edges * sizeof(EdgeNode) + h.num_kids * sizeof(size_t);
+#ifndef __linux__
+		image->own.resize((image->len + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+		rewind(f);
+		if (fread(image->own.data(), 1, image->len, f) != image->len)
+			throw std::runtime_error("truncated model image");
+		image->map_addr = nullptr;
+#endif
+	}
+	const char *base;
+#ifdef __linux__
+	int fd = open(path.c_str(), O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < image->len) {
+		if (fd >= 0) close(fd);
+		throw std::runtime_error("truncated model image");
+	}
+	void *addr = mmap(nullptr, image->len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) throw std::runtime_error("cannot map " + path);
+	image->map_addr = addr;
+	base = static_cast<const char *>(addr);
+#else
+	base = reinterpret_cast<const char *>(image->own.data());
+#endif
+	image->gram_size = h.gram_size;
+	image->root = (size_t)h.root;
+	image->start_idx = (size_t)h.start_idx;
+	image->num_nodes = (size_t)h.num_nodes;
+	image->num_edges = (size_t)h.num_edges;
+	image->num_kids = (size_t)h.num_kids;
+	image->node_arr = reinterpret_cast<const FlatNode *>(base + sizeof(h));
+	image->edge_arr = reinterpret_cast<const EdgeNode *>(base + sizeof(h) + image->num_nodes * sizeof(FlatNode));
+	image->kid_arr = reinterpret_cast<const size_t *>(base + sizeof(h) + image->num_nodes * sizeof(FlatNode) + image->num_edges * sizeof(EdgeNode));
+	return image;
+}
+
+bool ModelImage::is_image(const string &path) {
+	FILE *f = fopen(path.c_str(), "rb");
+	if (f == nullptr) return false;
+	char magic[sizeof(image_magic)];
+	bool ok = fread(magic, 1, sizeof(magic), f) == sizeof(magic) && memcmp(magic, image_magic, sizeof(magic)) == 0;
+	fclose(f);
+	return ok;
+}
@@ -0,0 +1,59 @@
+/*
+ * modelImage.hpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include <vector>
+#include <string>
+#include <memory>
+
+#include "common.hpp"
+#include "baseNode.hpp"
+
+namespace smoothPwd
+{
+	class ModelImage {
+		// a trained tree (see BaseTrieModel::save_image) as one flat file: FlatNodes, EdgeNodes and the
+		// kid array back to back, in memory layout. a loaded image is the file mapped read-only, so a model
+		// is ready without training or parsing, and its pages are shared by every process that maps it.
+		// images are for the machine (and build) that wrote them: the header checks the record sizes
+	public:
+		int gram_size;
+		size_t root, start_idx;
+		size_t num_nodes, num_edges, num_kids;
+
+		ModelImage(const ModelImage &) = delete;
+
+		~ModelImage();
+
+		const FlatNode *nodes() const { return node_arr; }
+
+		const EdgeNode *edges() const { return edge_arr; }
+
+		const size_t *kids() const { return kid_arr; }
+
+		size_t bytes() const { return len; } // of the file
+
+		static void save(const std::string &path, int gram_size, size_t root, size_t start_idx, const FlatNode *nodes, size_t num_nodes,
+			const EdgeNode *edges, size_t num_edges, const size_t *kids, size_t num_kids);
+
+		static std::shared_ptr<const ModelImage> map(const std::string &path); // mapped, not read
+
+		static bool is_image(const std::string &path); // whether path starts like a model image
+
+	private:
+		const FlatNode *node_arr;
+		const EdgeNode *edge_arr;
+		const size_t *kid_arr;
+		std::vector<uint64_t> own; // the file, where it cannot be mapped
+		void *map_addr;
+		size_t len;
+
+		ModelImage() : gram_size(0), root(0), start_idx(0), num_nodes(0), num_edges(0), num_kids(0),
+			node_arr(nullptr), edge_arr(nullptr), kid_arr(nullptr), map_addr(nullptr), len(0) {}
+	};
+} // namespace smoothPwd
@@ -0,0 +1,134 @@
+/*
+ * modelMemory.cpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#include "modelMemory.hpp"
+
+#include <cstdio>
+#include <fstream>
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+using std::string;
+using std::vector;
+
+#ifdef __linux__
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+
+static inline size_t round_up(size_t bytes) {
+	return (bytes + smoothPwd::HUGE_PAGE_SIZE - 1) & ~(smoothPwd::HUGE_PAGE_SIZE - 1);
+}
+
+static void *map_aligned(size_t len) { // anonymous mapping aligned to HUGE_PAGE_SIZE, so THP can back all of it
+	size_t over = len + smoothPwd::HUGE_PAGE_SIZE;
+	void *raw = mmap(nullptr, over, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw == MAP_FAILED) return nullptr;
+	char *base = static_cast<char *>(raw);
+	char *p = reinterpret_cast<char *>(round_up(reinterpret_cast<size_t>(base)));
+	if (p > base) munmap(base, p - base);
+	if (base + over > p + len) munmap(p + len, base + over - (p + len));
+	return p;
+}
+#endif
+
+void *smoothPwd::page_alloc(size_t bytes, PageMode mode) {
+#ifdef __linux__
+	size_t len = round_up(bytes);
+	if (mode == PAGES_EXPLICIT) {
+		void *p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+		if (p != MAP_FAILED) return p;
+		// no reserved huge pages; transparent ones are the next best thing
+	}
+	void *p = map_aligned(len);
+	if (p != nullptr) {
+#ifdef MADV_HUGEPAGE
+		madvise(p, len, MADV_HUGEPAGE); // only a hint; a kernel without THP just ignores it
+#endif
+		return p;
+	}
+	return nullptr;
+#else
+	(void)mode;
+	return ::operator new(bytes, std::nothrow);
+#endif
+}
+
+void smoothPwd::page_free(void *p, size_t bytes, PageMode mode) {
+	if (p == nullptr) return;
+#ifdef __linux__
+	(void)mode;
+	munmap(p, round_up(bytes)); // both kinds of mapping are HUGE_PAGE_SIZE-aligned and -sized
+#else
+	(void)bytes; (void)mode;
+	::operator delete(p);
+#endif
+}
+
+static vector<int> parse_list(const string &path) { // "0-3,8-11" -> 0 1 2 3 8 9 10 11
+	vector<int> res;
+	std::ifstream fin(path);
+	string line;
+	if (!std::getline(fin, line)) return res;
+	int lo = -1, cur = -1;
+	for (size_t i = 0; i <= line.size(); i++) {
+		char c = i < line.size() ? line[i] : ',';
+		if (c >= '0' && c <= '9') cur = (cur < 0 ? 0 : cur * 10) + (c - '0');
+		else if (c == '-') {
+			lo = cur;
+			cur = -1;
+		}
+		else if (c == ',' || c == '\n') {
+			if (cur >= 0) for (int x = lo >= 0 ? lo : cur; x <= cur; x++) res.push_back(x);
+			lo = cur = -1;
+		}
+	}
+	return res;
+}
+
+int smoothPwd::numa_num_nodes() {
+	vector<int> nodes = parse_list("/sys/devices/system/node/online");
+	return nodes.empty() ? 1 : nodes.back() + 1;
+}
+
+vector<int> smoothPwd::numa_node_cpus(int node) {
+	return parse_list("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+}
+
+bool smoothPwd::numa_bind_thread(int node) {
+#ifdef __linux__
+	vector<int> cpus = numa_node_cpus(node);
+	if (cpus.empty()) return false;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu : cpus) {
+		if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+	}
+	if (sched_setaffinity(0, sizeof(set), &set) != 0) return false;
+#ifdef SYS_set_mempolicy
+	// prefer the node's memory for what this thread allocates from now on; first touch by a thread
+	// running there already does that, so a failure here is harmless
+	const int MPOL_PREFERRED = 1;
+	unsigned long mask[16] = {};
+	if (node < (int)(sizeof(mask) * 8)) {
+		mask[node / (sizeof(unsigned long) * 8)] |= 1UL << (node % (sizeof(unsigned long) * 8));
+		syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask) * 8);
+	}
+#endif
+	thread_numa_node() = node;
+	return true;
+#else
+	(void)node;
+	return false;
+#endif
+}
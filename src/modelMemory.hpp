@@ -0,0 +1,82 @@
+/*
+ * modelMemory.hpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <string>
+#include <vector>
+
+namespace smoothPwd
+{
+	// where large model arrays live. everything falls back to ordinary pages when the requested
+	// kind is not available (no hugetlb pages reserved, THP disabled, not Linux, ...)
+	enum PageMode {
+		PAGES_DEFAULT,     // operator new
+		PAGES_TRANSPARENT, // 2 MiB-aligned mmap + madvise(MADV_HUGEPAGE)
+		PAGES_EXPLICIT     // mmap(MAP_HUGETLB), needs reserved pages (vm.nr_hugepages); else as PAGES_TRANSPARENT
+	};
+
+	const size_t HUGE_PAGE_SIZE = (size_t)2 << 20;
+
+	void *page_alloc(size_t bytes, PageMode mode);
+
+	void page_free(void *p, size_t bytes, PageMode mode);
+
+	template <typename T>
+	class PageAllocator { // std allocator on top of page_alloc; only blocks of >= HUGE_PAGE_SIZE are mmap'ed
+	public:
+		typedef T value_type;
+		typedef std::true_type propagate_on_container_copy_assignment;
+		typedef std::true_type propagate_on_container_move_assignment;
+		typedef std::true_type propagate_on_container_swap;
+
+		PageMode mode;
+
+		PageAllocator(PageMode _mode = PAGES_DEFAULT) : mode(_mode) {}
+
+		template <typename U>
+		PageAllocator(const PageAllocator<U> &other) : mode(other.mode) {}
+
+		T *allocate(size_t n) {
+			size_t bytes = n * sizeof(T);
+			if (mode == PAGES_DEFAULT || bytes < HUGE_PAGE_SIZE)
+				return static_cast<T *>(::operator new(bytes));
+			void *p = page_alloc(bytes, mode);
+			if (p == nullptr) throw std::bad_alloc();
+			return static_cast<T *>(p);
+		}
+
+		void deallocate(T *p, size_t n) {
+			size_t bytes = n * sizeof(T);
+			if (mode == PAGES_DEFAULT || bytes < HUGE_PAGE_SIZE)
+				::operator delete(p);
+			else page_free(p, bytes, mode);
+		}
+
+		template <typename U>
+		bool operator==(const PageAllocator<U> &other) const { return mode == other.mode; }
+
+		template <typename U>
+		bool operator!=(const PageAllocator<U> &other) const { return mode != other.mode; }
+	};
+
+	// NUMA topology from /sys/devices/system/node; a machine without it is a single node
+
+	int numa_num_nodes();
+
+	std::vector<int> numa_node_cpus(int node);
+
+	// pin the calling thread to the CPUs of `node` (and prefer its memory); the thread is then served
+	// by the model replica on that node (see BaseTrieModel::replicate_numa). false if it cannot be done
+	bool numa_bind_thread(int node);
+
+	inline int &thread_numa_node() { // node the calling thread is bound to, -1 if none
+		static thread_local int node = -1;
+		return node;
+	}
+} // namespace smoothPwd
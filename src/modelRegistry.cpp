@@ -0,0 +1,151 @@
+/*
+ * modelRegistry.cpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#include "modelRegistry.hpp"
+#include "kneserNey.hpp"
+#include "backoff.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <stdexcept>
+
+using smoothPwd::ModelRegistry;
+using smoothPwd::ModelSpec;
+using smoothPwd::BaseTrieModel;
+using smoothPwd::ModelImage;
+using smoothPwd::SimpleTrie;
+using std::string;
+
+std::unique_ptr<BaseTrieModel> ModelRegistry::build(const ModelSpec &spec) {
+	std::unique_ptr<BaseTrieModel> model;
+	if (spec.model_name == "backoff") model.reset(new KatzBackoffModel(spec.model_arg));
+	else model.reset(new ModifiedKneserNeyModel(spec.model_arg)); // kneserney by default
+
+	if (ModelImage::is_image(spec.path)) { // mapped: nothing to train, and shared with other processes
+		model->map_image(spec.path);
+		return model;
+	}
+	if (SimpleTrie::is_saved(spec.path)) { // a damaged counts file throws, rather than pass for a wordlist
+		model->train(SimpleTrie::load(spec.path));
+		return model;
+	}
+	std::ifstream fin(spec.path);
+	if (!fin) throw std::runtime_error("cannot open " + spec.path);
+	std::vector<string> data;
+	string line;
+	while (std::getline(fin, line)) data.push_back(line);
+	model->train(data);
+	return model;
+}
+
+void ModelRegistry::add(const string &id, const ModelSpec &spec) {
+	std::lock_guard<std::mutex> lock(mu);
+	auto it = entries.find(id);
+	if (it != entries.end()) drop(it->second);
+	Entry &e = entries[id];
+	e.spec = spec;
+	e.ticket = 0;
+	e.bytes = 0;
+	e.in_lru = false;
+}
+
+void ModelRegistry::drop(Entry &e) {
+	if (e.in_lru) {
+		lru.erase(e.lru_pos);
+		e.in_lru = false;
+		cnt.resident_models--;
+		cnt.resident_bytes -= e.bytes;
+		cnt.evictions++;
+	}
+	e.model = ModelFuture(); // a model being built is still handed to those waiting for it
+	e.ticket = 0;
+	e.bytes = 0;
+}
+
+void ModelRegistry::shrink(const string &keep) {
+	auto it = lru.end();
+	while (cnt.resident_bytes > mem_budget && it != lru.begin()) {
+		--it;
+		if (*it == keep) continue;
+		Entry &e = entries[*it];
+		++it; // drop() takes the victim out of lru
+		drop(e);
+	}
+}
+
+std::shared_ptr<const BaseTrieModel> ModelRegistry::get(const string &id) {
+	std::promise<std::shared_ptr<const BaseTrieModel> > built;
+	ModelSpec spec;
+	ull ticket;
+	{
+		std::unique_lock<std::mutex> lock(mu);
+		auto it = entries.find(id);
+		if (it == entries.end()) throw std::out_of_range("unknown model " + id);
+		Entry &e = it->second;
+		if (e.model.valid()) { // resident, or being built by another thread
+			cnt.hits++;
+			if (e.in_lru) lru.splice(lru.begin(), lru, e.lru_pos);
+			ModelFuture f = e.model;
+			lock.unlock();
+			return f.get();
+		}
+		cnt.misses++;
+		e.model = built.get_future().share();
+		e.ticket = ticket = ++next_ticket;
+		spec = e.spec;
+	}
+
+	// built outside the lock: other models are served meanwhile
+	auto t0 = std::chrono::steady_clock::now();
+	std::shared_ptr<const BaseTrieModel> model;
+	try {
+		model = build(spec);
+	}
+	catch (...) {
+		{
+			std::lock_guard<std::mutex> lock(mu);
+			Entry &e = entries[id];
+			if (e.ticket == ticket) { // the next get() tries again
+				e.model = ModelFuture();
+				e.ticket = 0;
+			}
+		}
+		built.set_exception(std::current_exception());
+		throw;
+	}
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	TrieStats st = model->stats();
+	size_t bytes = st.tree_bytes * (1 + st.replicas);
+
+	{
+		std::lock_guard<std::mutex> lock(mu);
+		cnt.load_seconds += secs;
+		cnt.max_load_seconds = std::max(cnt.max_load_seconds, secs);
+		Entry &e = entries[id];
+		if (e.ticket == ticket) { // not evicted or re-registered while it was built
+			e.bytes = bytes;
+			lru.push_front(id);
+			e.lru_pos = lru.begin();
+			e.in_lru = true;
+			cnt.resident_models++;
+			cnt.resident_bytes += bytes;
+			shrink(id);
+		}
+	}
+	built.set_value(model);
+	return model;
+}
+
+ModelRegistry::Counters ModelRegistry::counters() const {
+	std::lock_guard<std::mutex> lock(mu);
+	return cnt;
+}
+
+void ModelRegistry::evict(const string &id) {
+	std::lock_guard<std::mutex> lock(mu);
+	auto it = entries.find(id);
+	if (it != entries.end()) drop(it->second);
+}
@@ -0,0 +1,79 @@
+/*
+ * modelRegistry.hpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <future>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include "common.hpp"
+#include "baseTrie.hpp"
+
+namespace smoothPwd
+{
+	struct ModelSpec {
+		std::string path;       // a model image (BaseTrieModel::save_image), counts saved by SimpleTrie::save, or a training wordlist
+		std::string model_name; // "kneserney" or "backoff"
+		int model_arg;
+	};
+
+	class ModelRegistry {
+		// many models (sites, languages) by id, each built on first use and kept while the budget allows:
+		// when the resident models outgrow it, the least recently used go first. models are handed out as
+		// shared_ptr, so every thread shares the one copy, and a model still in use outlives its eviction.
+		// a model being built is waited for by everyone asking for it, not built twice. thread-safe
+	public:
+		struct Counters {
+			ull hits, misses, evictions;   // a get() of a model that is resident (or being built) is a hit
+			double load_seconds;           // spent building models, in total
+			double max_load_seconds;
+			size_t resident_models, resident_bytes;
+
+			Counters() : hits(0), misses(0), evictions(0), load_seconds(0), max_load_seconds(0), resident_models(0), resident_bytes(0) {}
+		};
+
+		explicit ModelRegistry(size_t _mem_budget) : mem_budget(_mem_budget), next_ticket(0) {}
+
+		void add(const std::string &id, const ModelSpec &spec); // (re)registers id; a resident model of it is dropped
+
+		// the model of id, built if not resident; throws std::out_of_range for an unknown id, and what
+		// building throws (the next get() tries again)
+		std::shared_ptr<const BaseTrieModel> get(const std::string &id);
+
+		void evict(const std::string &id); // drop it now, if resident
+
+		Counters counters() const;
+
+		// a model as a spec describes it (an image is mapped, counts are loaded, a wordlist is trained on)
+		static std::unique_ptr<BaseTrieModel> build(const ModelSpec &spec);
+
+	private:
+		typedef std::shared_future<std::shared_ptr<const BaseTrieModel> > ModelFuture;
+
+		struct Entry {
+			ModelSpec spec;
+			ModelFuture model;  // valid while resident or being built
+			size_t bytes;       // 0 while being built
+			ull ticket;         // of the build in progress or resident (0: none), so a stale build is not kept
+			std::list<std::string>::iterator lru_pos;
+			bool in_lru;
+		};
+
+		const size_t mem_budget;
+		mutable std::mutex mu;
+		std::unordered_map<std::string, Entry> entries;
+		std::list<std::string> lru; // resident ids, most recently used first
+		Counters cnt;
+		ull next_ticket;
+
+		void drop(Entry &e); // mu held
+
+		void shrink(const std::string &keep); // evict from the LRU end (never keep) until within budget; mu held
+	};
+} // namespace smoothPwd
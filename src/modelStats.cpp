@@ -0,0 +1,97 @@
+/*
+ * modelStats.cpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#include "modelStats.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <fstream>
+#include <string>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+
+using smoothPwd::MemoryPhase;
+using smoothPwd::TrieStats;
+using std::string;
+
+size_t smoothPwd::current_rss() {
+#ifdef __linux__
+	std::ifstream fin("/proc/self/statm");
+	size_t pages = 0, resident = 0;
+	if (fin >> pages >> resident) return resident * (size_t)sysconf(_SC_PAGESIZE);
+#endif
+	return 0;
+}
+
+size_t smoothPwd::peak_rss() {
+#ifdef __linux__
+	std::ifstream fin("/proc/self/status");
+	string line;
+	while (std::getline(fin, line)) {
+		if (line.compare(0, 6, "VmHWM:") == 0) return (size_t)atoll(line.c_str() + 6) << 10; // kB
+	}
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) == 0) return (size_t)ru.ru_maxrss << 10;
+#endif
+	return 0;
+}
+
+bool smoothPwd::reset_peak_rss() {
+#ifdef __linux__
+	FILE *f = fopen("/proc/self/clear_refs", "w");
+	if (f == nullptr) return false;
+	bool ok = fputs("5", f) >= 0;
+	return (fclose(f) == 0) && ok;
+#else
+	return false;
+#endif
+}
+
+MemoryPhase::MemoryPhase(std::vector<PhaseMemory> &_log, const char *name, bool _on) : log(_log), start(clock()), span(name), on(_on) {
+	if (!on) return;
+	ph.name = name;
+	ph.exact = reset_peak_rss();
+	ph.rss_before = current_rss();
+	ph.rss_after = ph.peak = 0;
+	ph.seconds = 0.0;
+}
+
+MemoryPhase::~MemoryPhase() {
+	if (!on) return;
+	ph.rss_after = current_rss();
+	ph.peak = std::max(peak_rss(), ph.rss_after);
+	ph.seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+	log.push_back(ph);
+}
+
+void TrieStats::print(std::ostream &out) const {
+	auto mib = [](size_t bytes) { return (double)bytes / (1 << 20); };
+	out << "nodes: " << num_nodes << " (capacity " << node_capacity << ")\n";
+	if (edge_nodes > 0) out << "edge nodes: " << edge_nodes << "\n";
+	out << "nodes per level:";
+	for (size_t l = 0; l < level_nodes.size(); l++) {
+		if (level_nodes[l] > 0) out << ' ' << l << ':' << level_nodes[l];
+	}
+	out << "\nkids: " << kids << " (capacity " << kid_capacity << ")\n";
+	if (tails > 0) out << "tails: " << tails << ", " << mib(tail_bytes) << " MiB\n";
+	out << "tree: " << mib(tree_bytes) << " MiB";
+	if (replicas > 0) out << " (+" << replicas << " NUMA replicas)";
+	out << '\n';
+	if (count_nodes > 0) {
+		out << "counting trie: " << count_nodes << " nodes";
+		if (count_bytes > 0) out << ", " << mib(count_bytes) << " MiB";
+		else out << " (merged from disk)";
+		out << '\n';
+	}
+	if (table_entries > 0) out << "Kneser-Ney table: " << table_entries << " entries, ~" << mib(table_bytes) << " MiB\n";
+	for (const auto &ph : phases) {
+		out << "phase " << ph.name << ": " << ph.seconds << " s, rss " << mib(ph.rss_before) << " -> " << mib(ph.rss_after)
+			<< " MiB, peak " << (ph.exact ? "" : "(process) ") << mib(ph.peak) << " MiB\n";
+	}
+}
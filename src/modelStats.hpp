@@ -0,0 +1,70 @@
+/*
+ * modelStats.hpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <ctime>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "trace.hpp"
+
+namespace smoothPwd
+{
+	// process memory (bytes) as the kernel sees it; 0 where it cannot be read
+	size_t current_rss();
+
+	size_t peak_rss();
+
+	bool reset_peak_rss(); // restart the high-water mark (Linux >= 4.0); false if not possible
+
+	struct PhaseMemory {
+		std::string name;
+		size_t rss_before, rss_after; // resident set at the start / end of the phase
+		size_t peak;                  // highest resident set during the phase
+		bool exact;                   // false: peak is the process high-water mark so far (could not reset it)
+		double seconds;
+	};
+
+	class MemoryPhase { // RAII: appends the memory profile of one phase to a log; also a trace span
+	private:
+		std::vector<PhaseMemory> &log;
+		PhaseMemory ph;
+		std::clock_t start;
+		TraceSpan span;
+		const bool on;
+
+	public:
+		// off: no profile is taken (nor the peak RSS reset), only the trace span
+		MemoryPhase(std::vector<PhaseMemory> &_log, const char *name, bool _on);
+
+		~MemoryPhase();
+
+		MemoryPhase(const MemoryPhase &) = delete;
+
+		void arg(const char *key, long long val) { span.arg(key, val); }
+	};
+
+	struct TrieStats {
+		size_t num_nodes;                // nodes in tree
+		size_t edge_nodes;               // nodes folded into compressed edges (see EdgeNode)
+		size_t node_capacity;            // nodes tree has room for
+		std::vector<size_t> level_nodes; // level_nodes[l]: nodes at level l (root is 0)
+		size_t kids, kid_capacity;       // kid slots used / allocated over all kid vectors
+		size_t tails, tail_bytes;        // SimpleTrie: suffixes not expanded into nodes yet, and their buffers
+		size_t tree_bytes;               // node array + kid vectors + tails
+		size_t replicas;                 // extra NUMA copies of the tree, tree_bytes each
+		size_t count_nodes, count_bytes; // the counting trie a model was built from (gone by now; no bytes if counted on disk)
+		size_t table_entries, table_bytes; // Kneser-Ney: the expanded NodeTable (only alive during training; bytes are approx.)
+		std::vector<PhaseMemory> phases; // training phases, in order
+
+		TrieStats() : num_nodes(0), edge_nodes(0), node_capacity(0), kids(0), kid_capacity(0), tails(0), tail_bytes(0), tree_bytes(0),
+			replicas(0), count_nodes(0), count_bytes(0), table_entries(0), table_bytes(0) {}
+
+		void print(std::ostream &out) const;
+	};
+} // namespace smoothPwd
@@ -0,0 +1,92 @@
+/*
+ * policy.hpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "common.hpp"
+
+namespace smoothPwd
+{
+	// a policy is a small automaton run alongside the threshold search: step() feeds it one char
+	// and rejects chars (or states) that can never reach acceptance, accepts() is checked at [ed].
+
+	class NoPolicy { // the unconstrained search; compiles away
+	public:
+		struct State {
+			bool operator==(const State &) const { return true; }
+		};
+
+		State start() const { return State(); }
+
+		bool step(const State &, char, State &) const { return true; }
+
+		bool accepts(const State &) const { return true; }
+	};
+
+	class PasswordPolicy {
+		// length bounds, required char classes, and optional fixed prefix / suffix
+	public:
+		enum CharClass { LOWER = 1, UPPER = 2, DIGIT = 4, SYMBOL = 8 };
+
+		struct State {
+			int len;     // chars so far
+			int classes; // char classes seen so far
+			int matched; // longest suffix of the guess that is a prefix of `suffix` (KMP state)
+
+			bool operator==(const State &o) const { return len == o.len && classes == o.classes && matched == o.matched; }
+		};
+
+		const int min_len, max_len;
+		const int required;
+		const std::string prefix, suffix;
+
+		PasswordPolicy(int _min_len = 0, int _max_len = MAX_LENGTH, int _required = 0,
+			const std::string &_prefix = "", const std::string &_suffix = "") :
+			min_len(_min_len), max_len(_max_len), required(_required), prefix(_prefix), suffix(_suffix), kmp(_suffix.size() + 1, 0) {
+			for (size_t i = 1, k = 0; i < suffix.size(); i++) {
+				while (k > 0 && suffix[i] != suffix[k]) k = kmp[k];
+				if (suffix[i] == suffix[k]) ++k;
+				kmp[i + 1] = (int)k;
+			}
+		}
+
+		static inline int char_class(char c) {
+			if (c >= 'a' && c <= 'z') return LOWER;
+			if (c >= 'A' && c <= 'Z') return UPPER;
+			if (c >= '0' && c <= '9') return DIGIT;
+			return SYMBOL;
+		}
+
+		State start() const { return State{ 0, 0, 0 }; }
+
+		inline bool step(const State &st, char c, State &nt) const {
+			if (st.len < (int)prefix.size() && c != prefix[st.len]) return false;
+			nt.len = st.len + 1;
+			nt.classes = st.classes | char_class(c);
+			int k = st.matched == (int)suffix.size() ? kmp[suffix.size()] : st.matched;
+			while (k > 0 && c != suffix[k]) k = kmp[k];
+			nt.matched = (!suffix.empty() && c == suffix[k]) ? k + 1 : 0;
+			return nt.len + chars_needed(nt) <= max_len; // can still be completed in time
+		}
+
+		inline bool accepts(const State &st) const {
+			return st.len >= min_len && st.len <= max_len && (st.classes & required) == required
+				&& st.len >= (int)prefix.size() && st.matched == (int)suffix.size();
+		}
+
+	private:
+		std::vector<int> kmp; // KMP failure function of suffix
+
+		inline int chars_needed(const State &st) const { // lower bound on chars still to come
+			int missing = 0;
+			for (int x = required & ~st.classes; x; x &= x - 1) ++missing;
+			return std::max(missing, std::max((int)prefix.size() - st.len, (int)suffix.size() - st.matched));
+		}
+	};
+} // namespace smoothPwd
@@ -0,0 +1,256 @@
+/*
+ * rankIndex.cpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#include "rankIndex.hpp"
+#include "guessFilter.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using smoothPwd::GuessRankIndex;
+using smoothPwd::ull;
+using std::string;
+using std::vector;
+
+namespace
+{
+	const char index_magic[8] = { 'S', 'P', 'W', 'D', 'R', 'N', 'K', '1' };
+	const size_t header_bytes = sizeof(index_magic) + 3 * sizeof(uint64_t);
+	const uint16_t fingerprint_mask = (1 << GuessRankIndex::FINGERPRINT_BITS) - 1;
+
+	inline uint64_t mix(uint64_t key, uint64_t seed) { // MurmurHash3 finalizer of key + seed
+		uint64_t x = key + seed;
+		x ^= x >> 33;
+		x *= 0xff51afd7ed558ccdULL;
+		x ^= x >> 33;
+		x *= 0xc4ceb9fe1a85ec53ULL;
+		x ^= x >> 33;
+		return x;
+	}
+
+	inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+	inline size_t reduce(uint32_t x, size_t n) { return (size_t)(((uint64_t)x * n) >> 32); } // x mod n, without the division
+
+	inline void slots_of(uint64_t h, size_t segment, size_t idx[3]) {
+		idx[0] = reduce((uint32_t)h, segment);
+		idx[1] = reduce((uint32_t)rotl(h, 21), segment) + segment;
+		idx[2] = reduce((uint32_t)rotl(h, 42), segment) + 2 * segment;
+	}
+
+	inline uint16_t fingerprint(uint64_t h) { return (uint16_t)((h ^ (h >> 32)) & fingerprint_mask); }
+}
+
+void GuessRankIndex::Builder::add(const char *s, size_t len) {
+	int bucket = 0;
+	for (ull r = rank + 1; r > 1; r >>= 1) ++bucket;
+	entries.push_back(Entry{ GuessFilter::hash(s, len), (uint8_t)bucket });
+	++rank;
+}
+
+GuessRankIndex GuessRankIndex::Builder::build() {
+	// a guess listed twice keeps its best rank; equal keys would never peel
+	std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.key < b.key || (a.key == b.key && a.bucket < b.bucket); });
+	entries.erase(std::unique(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.key == b.key; }), entries.end());
+
+	GuessRankIndex index;
+	size_t n = entries.size();
+	index.num_keys = n;
+	index.segment = (size_t)std::ceil((1.23 * (double)n + 32) / 3);
+	size_t capacity = 3 * index.segment;
+
+	vector<uint32_t> count(capacity);
+	vector<uint64_t> members(capacity); // xor of the entries hashed to a slot: the entry itself once one is left
+	vector<size_t> queue;
+	vector<std::pair<uint64_t, size_t> > order; // (entry, slot it was peeled from)
+	queue.reserve(capacity);
+	order.reserve(n);
+	uint64_t seed = 0x9E3779B97F4A7C15ULL;
+	for (;;) { // peeling fails with a small prob.; another seed is another hypergraph
+		std::fill(count.begin(), count.end(), 0);
+		std::fill(members.begin(), members.end(), 0);
+		queue.clear();
+		order.clear();
+		size_t idx[3];
+		for (size_t e = 0; e < n; e++) {
+			slots_of(mix(entries[e].key, seed), index.segment, idx);
+			for (int j = 0; j < 3; j++) {
+				count[idx[j]]++;
+				members[idx[j]] ^= e;
+			}
+		}
+		for (size_t i = 0; i < capacity; i++)
+			if (count[i] == 1) queue.push_back(i);
+		while (!queue.empty()) {
+			size_t i = queue.back();
+			queue.pop_back();
+			if (count[i] != 1) continue;
+			uint64_t e = members[i];
+			order.emplace_back(e, i);
+			slots_of(mix(entries[e].key, seed), index.segment, idx);
+			for (int j = 0; j < 3; j++) {
+				members[idx[j]] ^= e;
+				if (--count[idx[j]] == 1) queue.push_back(idx[j]);
+			}
+		}
+		if (order.size() == n) break;
+		seed = mix(seed, 0x9E3779B97F4A7C15ULL);
+	}
+
+	// in reverse peeling order, each entry's slot is the last of its three to be set
+	index.seed = seed;
+	index.own.assign(capacity, 0);
+	for (size_t k = n; k-- > 0;) {
+		uint64_t e = order[k].first;
+		size_t i = order[k].second, idx[3];
+		uint64_t h = mix(entries[e].key, seed);
+		slots_of(h, index.segment, idx);
+		uint16_t v = (uint16_t)(fingerprint(h) | entries[e].bucket << FINGERPRINT_BITS);
+		index.own[i] = v ^ index.own[idx[0]] ^ index.own[idx[1]] ^ index.own[idx[2]]; // own[i] is still 0
+	}
+	index.slots = index.own.data();
+	entries.clear();
+	rank = 0;
+	return index;
+}
+
+GuessRankIndex::GuessRankIndex() : seed(0), segment(0), num_keys(0), slots(nullptr), map_addr(nullptr), map_len(0) {}
+
+GuessRankIndex::GuessRankIndex(GuessRankIndex &&other) : GuessRankIndex() {
+	*this = std::move(other);
+}
+
+GuessRankIndex &GuessRankIndex::operator=(GuessRankIndex &&other) {
+	if (this == &other) return *this;
+	release();
+	seed = other.seed;
+	segment = other.segment;
+	num_keys = other.num_keys;
+	bool owned = other.slots == other.own.data();
+	own.swap(other.own);
+	slots = owned ? own.data() : other.slots;
+	map_addr = other.map_addr;
+	map_len = other.map_len;
+	other.own.clear();
+	other.slots = nullptr;
+	other.map_addr = nullptr;
+	other.map_len = 0;
+	other.segment = other.num_keys = 0;
+	return *this;
+}
+
+GuessRankIndex::~GuessRankIndex() {
+	release();
+}
+
+void GuessRankIndex::release() {
+#ifdef __linux__
+	if (map_addr != nullptr) munmap(map_addr, map_len);
+#endif
+	map_addr = nullptr;
+	map_len = 0;
+	slots = nullptr;
+	own.clear();
+}
+
+int GuessRankIndex::rank_bucket(const char *s, size_t len) const {
+	if (segment == 0) return -1;
+	uint64_t h = mix(GuessFilter::hash(s, len), seed);
+	size_t idx[3];
+	slots_of(h, segment, idx);
+	uint16_t v = slots[idx[0]] ^ slots[idx[1]] ^ slots[idx[2]];
+	return (v & fingerprint_mask) == fingerprint(h) ? v >> FINGERPRINT_BITS : -1;
+}
+
+GuessRankIndex GuessRankIndex::from_guess_file(const string &path, bool binary) {
+	Builder builder;
+	if (!binary) {
+		std::ifstream fin(path);
+		if (!fin) throw std::runtime_error("cannot open " + path);
+		string line;
+		while (std::getline(fin, line)) builder.add(line);
+		return builder.build();
+	}
+	FILE *f = fopen(path.c_str(), "rb");
+	if (f == nullptr) throw std::runtime_error("cannot open " + path);
+	std::unique_ptr<FILE, int (*)(FILE *)> guard(f, fclose);
+	uint16_t len;
+	char s[65536];
+	double p;
+	while (fread(&len, sizeof(len), 1, f) == 1) {
+		if (fread(s, 1, len, f) != len || fread(&p, sizeof(p), 1, f) != 1)
+			throw std::runtime_error("truncated guess file " + path);
+		builder.add(s, len);
+	}
+	return builder.build();
+}
+
+void GuessRankIndex::save(const string &path) const {
+	// [magic][seed][segment][#keys][3 * segment slots]
+	FILE *f = fopen(path.c_str(), "wb");
+	if (f == nullptr) throw std::runtime_error("cannot create " + path);
+	uint64_t sg = segment, nk = num_keys;
+	fwrite(index_magic, 1, sizeof(index_magic), f);
+	fwrite(&seed, sizeof(seed), 1, f);
+	fwrite(&sg, sizeof(sg), 1, f);
+	fwrite(&nk, sizeof(nk), 1, f);
+	if (segment > 0) fwrite(slots, sizeof(uint16_t), 3 * segment, f);
+	bool ok = ferror(f) == 0;
+	ok = (fclose(f) == 0) && ok;
+	if (!ok) throw std::runtime_error("cannot write " + path);
+}
+
+GuessRankIndex GuessRankIndex::load(const string &path) {
+	GuessRankIndex index;
+	uint64_t sg, nk;
+	{
+		FILE *f = fopen(path.c_str(), "rb");
+		if (f == nullptr) throw std::runtime_error("cannot open " + path);
+		std::unique_ptr<FILE, int (*)(FILE *)> guard(f, fclose);
+		char magic[sizeof(index_magic)];
+		if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, index_magic, sizeof(magic)) != 0)
+			throw std::runtime_error(path + " is not a guess rank index");
+		if (fread(&index.seed, sizeof(index.seed), 1, f) != 1 || fread(&sg, sizeof(sg), 1, f) != 1 || fread(&nk, sizeof(nk), 1, f) != 1)
+			throw std::runtime_error("truncated guess rank index");
+		index.segment = (size_t)sg;
+		index.num_keys = nk;
+		if (index.segment == 0) return index;
+#ifndef __linux__
+		index.own.resize(3 * index.segment);
+		if (fread(index.own.data(), sizeof(uint16_t), index.own.size(), f) != index.own.size())
+			throw std::runtime_error("truncated guess rank index");
+		index.slots = index.own.data();
+		return index;
+#endif
+	}
+#ifdef __linux__
+	size_t len = header_bytes + 3 * index.segment * sizeof(uint16_t);
+	int fd = open(path.c_str(), O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < len) {
+		if (fd >= 0) close(fd);
+		throw std::runtime_error("truncated guess rank index");
+	}
+	void *addr = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) throw std::runtime_error("cannot map " + path);
+	index.map_addr = addr;
+	index.map_len = len;
+	index.slots = reinterpret_cast<const uint16_t *>(static_cast<const char *>(addr) + header_bytes);
+#endif
+	return index;
+}
@@ -0,0 +1,84 @@
+/*
+ * rankIndex.hpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include <vector>
+#include <string>
+
+#include "common.hpp"
+
+namespace smoothPwd
+{
+	class GuessRankIndex {
+		// "is s among the model's first N guesses, and about where?" without the guesses: an xor filter
+		// (Graf & Lemire, "Xor filters: faster and smaller than Bloom and cuckoo filters", JEA'20) whose
+		// 16-bit slots hold a fingerprint and the rank bucket floor(log2(rank + 1)). a lookup reads three
+		// slots; ~20 bits per guess; a guess outside the top N passes as one with prob. 2^-FINGERPRINT_BITS.
+		// saved files are mapped read-only, so an index is shared by every process that opens it
+	public:
+		static const int FINGERPRINT_BITS = 10;
+
+		class Builder { // guesses are added best first: the i-th add() has rank i
+		private:
+			struct Entry {
+				uint64_t key;
+				uint8_t bucket;
+			};
+			std::vector<Entry> entries;
+			ull rank;
+
+		public:
+			Builder() : rank(0) {}
+
+			void add(const char *s, size_t len);
+
+			void add(const std::string &s) { add(s.data(), s.size()); }
+
+			GuessRankIndex build(); // clears the builder
+		};
+
+		GuessRankIndex();
+
+		GuessRankIndex(GuessRankIndex &&other);
+
+		GuessRankIndex &operator=(GuessRankIndex &&other);
+
+		GuessRankIndex(const GuessRankIndex &) = delete;
+
+		~GuessRankIndex();
+
+		// rank bucket b of s (its rank is in [2^b - 1, 2^(b+1) - 1)), or -1 if s is not in the index
+		int rank_bucket(const char *s, size_t len) const;
+
+		int rank_bucket(const std::string &s) const { return rank_bucket(s.data(), s.size()); }
+
+		bool contains(const std::string &s) const { return rank_bucket(s) >= 0; }
+
+		ull size() const { return num_keys; } // distinct guesses
+
+		size_t bytes() const { return 3 * segment * sizeof(uint16_t); }
+
+		// a guesser output (in guess order), TEXT or BINARY (see GuessWriter)
+		static GuessRankIndex from_guess_file(const std::string &path, bool binary = false);
+
+		void save(const std::string &path) const;
+
+		static GuessRankIndex load(const std::string &path); // mapped, not read
+
+	private:
+		uint64_t seed;
+		size_t segment;             // slots per hash function; 3 * segment in all
+		ull num_keys;
+		std::vector<uint16_t> own;  // the slots of a built index
+		const uint16_t *slots;      // own.data(), or inside the mapping of a loaded one
+		void *map_addr;
+		size_t map_len;
+
+		void release();
+	};
+} // namespace smoothPwd
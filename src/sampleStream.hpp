@@ -0,0 +1,66 @@
+/*
+ * sampleStream.hpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "common.hpp"
+
+namespace smoothPwd
+{
+	class SampleStream {
+		// counter-based random stream (Philox4x32-10; Salmon et al., "Parallel random numbers: as easy as
+		// 1, 2, 3", SC'11): the i-th number of stream (seed, index) is a pure function of the three, so
+		// a sample drawn from stream (seed, k) is the same on any thread, in any order, in any run
+	private:
+		uint32_t key[2];
+		uint32_t ctr[4];  // (index lo, index hi, block lo, block hi)
+		uint32_t out[4];  // the current block
+		int used;         // words of out already handed out
+
+		static inline void mulhilo(uint32_t a, uint32_t b, uint32_t &hi, uint32_t &lo) {
+			uint64_t prod = (uint64_t)a * b;
+			hi = (uint32_t)(prod >> 32);
+			lo = (uint32_t)prod;
+		}
+
+		void refill() {
+			uint32_t c[4] = { ctr[0], ctr[1], ctr[2], ctr[3] };
+			uint32_t k0 = key[0], k1 = key[1];
+			for (int r = 0; r < 10; r++) {
+				uint32_t hi0, lo0, hi1, lo1;
+				mulhilo(0xD2511F53u, c[0], hi0, lo0);
+				mulhilo(0xCD9E8D57u, c[2], hi1, lo1);
+				uint32_t n[4] = { hi1 ^ c[1] ^ k0, lo1, hi0 ^ c[3] ^ k1, lo0 };
+				c[0] = n[0], c[1] = n[1], c[2] = n[2], c[3] = n[3];
+				k0 += 0x9E3779B9u;
+				k1 += 0xBB67AE85u;
+			}
+			out[0] = c[0], out[1] = c[1], out[2] = c[2], out[3] = c[3];
+			used = 0;
+			if (++ctr[2] == 0) ++ctr[3];
+		}
+
+	public:
+		SampleStream(ull seed, ull index) : used(4) {
+			key[0] = (uint32_t)seed;
+			key[1] = (uint32_t)(seed >> 32);
+			ctr[0] = (uint32_t)index;
+			ctr[1] = (uint32_t)(index >> 32);
+			ctr[2] = ctr[3] = 0;
+		}
+
+		uint32_t next_u32() {
+			if (used == 4) refill();
+			return out[used++];
+		}
+
+		double uniform() { // in [0, 1), 53 random bits
+			uint64_t hi = next_u32(), lo = next_u32();
+			return (double)((hi << 32 | lo) >> 11) * (1.0 / 9007199254740992.0);
+		}
+	};
+} // namespace smoothPwd
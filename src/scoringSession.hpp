@@ -0,0 +1,58 @@
+/*
+ * scoringSession.hpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#pragma once
+
+#include <cmath>
+#include <vector>
+
+#include "baseTrie.hpp"
+
+namespace smoothPwd
+{
+	class ScoringSession {
+		// a password being typed, scored as it changes (e.g. a strength meter): push() and pop() cost one
+		// model step each instead of a pwd_prob of the whole string. holds the state and log prob. after
+		// every char typed, 16 bytes each, so many sessions can be kept open. the model must outlive it
+	private:
+		struct Step {
+			size_t state;   // after this char
+			double log_p;   // of the prefix up to and including it
+		};
+
+		const BaseTrieModel *model;
+		std::vector<Step> steps;
+
+		size_t state() const { return steps.empty() ? model->score_start() : steps.back().state; }
+
+	public:
+		explicit ScoringSession(const BaseTrieModel &_model) : model(&_model) {}
+
+		void push(char c) {
+			size_t st = state();
+			double p = model->score_step(st, c);
+			steps.push_back(Step{ st, prefix_log_prob() + std::log(p) });
+		}
+
+		void pop() { // undo the last push (backspace); nothing if empty
+			if (!steps.empty()) steps.pop_back();
+		}
+
+		void clear() { steps.clear(); }
+
+		size_t size() const { return steps.size(); }
+
+		// log prob. of the chars so far as the start of a password (-inf if the model rules it out)
+		double prefix_log_prob() const { return steps.empty() ? 0.0 : steps.back().log_p; }
+
+		// log prob. of the chars so far as a whole password: the end symbol is scored on demand
+		double log_prob() const {
+			size_t st = state();
+			return prefix_log_prob() + std::log(model->score_step(st, '\0'));
+		}
+
+		double prob() const { return std::exp(log_prob()); } // pwd_prob of the chars so far, up to rounding
+	};
+} // namespace smoothPwd
@@ -2,12 +2,16 @@
  * simpleTrie.cpp
  * Copyright (c) 2021 Yuanming Song
  */
-#include "simpletrie.hpp"
+#include "simpleTrie.hpp"
 
 #include <cassert>
+#include <cstdint>
+#include <stdexcept>
 
 using smoothPwd::SimpleTrie;
+using smoothPwd::SimpleNode;
 using smoothPwd::ull;
+using std::string;
 
 SimpleTrie::SimpleTrie(int _gram_size) : gram_size(_gram_size) {
 	root = add_node(0, nullptr, CHAR_NUM);
@@ -99,3 +103,281 @@ void SimpleTrie::add_pfx(const char *s, ull cnt, size_t idx) {
 	if (reach_end)
 		tree[cur].cnt_end += cnt; // end symbol
 }
+
+namespace
+{
+	struct SortedSuffix { // a suffix of the corpus text, cut to some limit
+		uint64_t key;     // its first 8 chars big-endian, zero-padded: keys compare like the suffixes
+		uint32_t pos;     // where it starts in the text
+		uint32_t id;      // the password it belongs to
+	};
+
+	SortedSuffix make_suffix(const char *text, uint32_t pos, uint32_t id, int limit) {
+		SortedSuffix x{ 0, pos, id };
+		int i = 0;
+		for (; i < 8 && i < limit && text[pos + i] != '\0'; i++) x.key = x.key << 8 | (unsigned char)text[pos + i];
+		if (i > 0) x.key <<= 8 * (8 - i);
+		return x;
+	}
+
+	void sort_suffixes(std::vector<SortedSuffix>::iterator first, std::vector<SortedSuffix>::iterator last, const char *text, int limit) {
+		std::sort(first, last, [text, limit](const SortedSuffix &a, const SortedSuffix &b) {
+			if (a.key != b.key) return a.key < b.key;
+			if ((a.key & 0xff) == 0 || limit <= 8) return false; // ended within the key
+			return strncmp(text + a.pos + 8, text + b.pos + 8, (size_t)(limit - 8)) < 0;
+		});
+	}
+
+	inline int common_prefix(const char *a, const char *b, int l) {
+		int i = 0;
+		while (i < l && a[i] == b[i]) ++i;
+		return i;
+	}
+}
+
+void SimpleTrie::add_corpus(const std::vector<std::pair<const char *, ull> > &corpus) {
+	if (tree.size() != (size_t)CHAR_NUM + 1 || tree[root].cnt != 0)
+		throw std::logic_error("add_corpus needs an empty trie");
+
+	// text: the passwords, each followed by '\0' (the end symbol)
+	size_t text_size = 0;
+	for (const auto &item : corpus) text_size += strlen(item.first) + 1;
+	if (text_size > UINT32_MAX || corpus.size() > UINT32_MAX) { // too big for 32-bit positions
+		for (const auto &item : corpus) add_sub(item.first, item.second);
+		return;
+	}
+	std::vector<char> text;
+	text.reserve(text_size);
+	std::vector<uint32_t> starts;
+	starts.reserve(corpus.size());
+	for (const auto &item : corpus) {
+		starts.push_back((uint32_t)text.size());
+		text.insert(text.end(), item.first, item.first + strlen(item.first) + 1);
+		tree[root].cnt += item.second;
+	}
+	const char *tx = text.data();
+
+	// emit the subtree below base from a sorted run. a string (suffix cut to limit) ends at its node,
+	// which gets its count; subtree sums are passed up as nodes leave the current path. the part of a
+	// string shared with neither neighbour becomes a tail, as add_pfx would have left it
+	auto add_run = [&](size_t base, const SortedSuffix *first, const SortedSuffix *last, int limit) {
+		std::vector<size_t> path(1, base);
+		std::vector<ull> sum(1, 0);
+		auto pop = [&]() {
+			ull s = sum.back();
+			tree[path.back()].cnt += s;
+			path.pop_back();
+			sum.pop_back();
+			sum.back() += s;
+		};
+
+		int prev_lcp = 0;
+		for (const SortedSuffix *x = first; x != last; x++) {
+			const char *s = tx + x->pos;
+			int len = (int)strnlen(s, (size_t)limit);
+			int next_lcp = 0;
+			if (x + 1 != last) {
+				const char *t = tx + x[1].pos;
+				next_lcp = common_prefix(s, t, std::min(len, (int)strnlen(t, (size_t)limit)));
+			}
+			while ((int)path.size() > prev_lcp + 1) pop();
+
+			int shared = std::max(prev_lcp, next_lcp);
+			for (int d = prev_lcp; d < len; d++) {
+				size_t kid = path.size() == 1 ? tree[path.back()].find_ch(s[d]) : 0; // level 1 nodes exist
+				if (kid == 0) {
+					char *tail = nullptr;
+					if (d == shared && d + 1 < len) {
+						tail = new char[len - d];
+						memcpy(tail, s + d + 1, (size_t)(len - d - 1));
+						tail[len - d - 1] = '\0';
+					}
+					bool leaf = (tail != nullptr || d + 1 == len) && next_lcp <= d + 1;
+					kid = add_node(0, tail, leaf ? 0 : 2); // leaves never get kids: no kid buffer
+					tree[path.back()].add_ch(s[d], kid);
+				}
+				path.push_back(kid);
+				sum.push_back(0);
+				if (tree[kid].s != nullptr) break;
+			}
+
+			ull cnt = corpus[x->id].second;
+			sum.back() += cnt;
+			if (len < limit) tree[path.back()].cnt_end += cnt;
+			prev_lcp = next_lcp;
+		}
+		while (path.size() > 1) pop();
+		tree[base].cnt += sum[0];
+	};
+
+	std::vector<SortedSuffix> run;
+	{ // start symbol: whole passwords, cut to gram_size - 1
+		int limit = gram_size - 1;
+		run.reserve(corpus.size());
+		for (uint32_t id = 0; id < (uint32_t)corpus.size(); id++) run.push_back(make_suffix(tx, starts[id], id, limit));
+		sort_suffixes(run.begin(), run.end(), tx, limit);
+		add_run(start_ch, run.data(), run.data() + run.size(), limit);
+	}
+
+	// all other suffixes, cut to gram_size, one bucket per first char. buckets are gathered a few at a
+	// time (one scan of the text each), so at most ~1/8 of all suffixes are held at once
+	std::vector<size_t> bucket_size(CHAR_NUM, 0);
+	for (size_t i = 0; i < text.size(); i++) {
+		if (tx[i] == '\0') continue;
+		int b = ord(tx[i]);
+		if (b < 0 || b >= CHAR_NUM) throw std::invalid_argument("unsupported character in corpus");
+		bucket_size[b]++;
+	}
+	size_t budget = std::max(*std::max_element(bucket_size.begin(), bucket_size.end()), (text.size() - corpus.size()) / 8);
+	for (int lo = 0, hi; lo < CHAR_NUM; lo = hi) {
+		std::vector<size_t> fill(CHAR_NUM, 0);
+		size_t n = 0;
+		for (hi = lo; hi < CHAR_NUM && n + bucket_size[hi] <= budget; hi++) {
+			fill[hi] = n;
+			n += bucket_size[hi];
+		}
+		run.resize(n);
+		for (uint32_t id = 0; id < (uint32_t)corpus.size(); id++) {
+			for (uint32_t p = starts[id]; tx[p] != '\0'; p++) {
+				int b = ord(tx[p]);
+				if (b >= lo && b < hi) run[fill[b]++] = make_suffix(tx, p, id, gram_size);
+			}
+		}
+		size_t from = 0;
+		for (int b = lo; b < hi; b++) { // fill[b] is now the end of bucket b
+			sort_suffixes(run.begin() + from, run.begin() + fill[b], tx, gram_size);
+			add_run(root, run.data() + from, run.data() + fill[b], gram_size);
+			from = fill[b];
+		}
+	}
+}
+
+smoothPwd::TrieStats SimpleTrie::stats() const {
+	TrieStats st;
+	st.num_nodes = tree.size();
+	st.node_capacity = tree.capacity();
+
+	std::vector<std::pair<size_t, size_t> > stk(1, std::make_pair(root, (size_t)0)); // (idx, level)
+	while (!stk.empty()) {
+		size_t idx = stk.back().first, level = stk.back().second;
+		stk.pop_back();
+		if (level >= st.level_nodes.size()) st.level_nodes.resize(level + 1, 0);
+		st.level_nodes[level]++;
+		for (size_t kid : tree[idx].ch) stk.emplace_back(kid, level + 1);
+	}
+
+	for (const auto &nd : tree) {
+		st.kids += nd.ch.size();
+		st.kid_capacity += nd.ch.capacity();
+		if (nd.s != nullptr) { // [pushed-down part as '\0's][tail]['\0']
+			size_t l = 0;
+			while (nd.s[l] == '\0') ++l;
+			st.tails++;
+			st.tail_bytes += l + strlen(nd.s + l) + 1;
+		}
+	}
+	st.tree_bytes = st.node_capacity * sizeof(SimpleNode) + st.kid_capacity * sizeof(size_t) + st.tail_bytes;
+	return st;
+}
+
+namespace
+{
+	const char counts_magic[8] = { 'S', 'P', 'W', 'D', 'C', 'N', 'T', '1' };
+
+	template <typename T>
+	inline void put(FILE *f, const T &x) { fwrite(&x, sizeof(x), 1, f); }
+
+	template <typename T>
+	inline void get(FILE *f, T &x) {
+		if (fread(&x, sizeof(x), 1, f) != 1) throw std::runtime_error("truncated counts file");
+	}
+}
+
+void SimpleTrie::save(const string &path) const {
+	// [magic][gram_size][root][start_ch][#nodes], then per node:
+	// [cnt][cnt_end][96 kid bits][#kids][kids...][tail length][tail chars]
+	FILE *f = fopen(path.c_str(), "wb");
+	if (f == nullptr) throw std::runtime_error("cannot create " + path);
+	fwrite(counts_magic, 1, sizeof(counts_magic), f);
+	put(f, (int32_t)gram_size);
+	put(f, (uint64_t)root);
+	put(f, (uint64_t)start_ch);
+	put(f, (uint64_t)tree.size());
+	for (const auto &nd : tree) {
+		put(f, (uint64_t)nd.cnt);
+		put(f, (uint64_t)nd.cnt_end);
+		unsigned char bits[CHAR_NUM / 8] = { 0 };
+		for (int i = 0; i < CHAR_NUM; i++) if (nd.v[i]) bits[i / 8] |= (unsigned char)(1 << (i % 8));
+		fwrite(bits, 1, sizeof(bits), f);
+		put(f, (uint32_t)nd.ch.size());
+		for (size_t kid : nd.ch) put(f, (uint64_t)kid);
+
+		const char *tail = nd.s;
+		if (tail != nullptr) while (*tail == '\0') ++tail; // skip the part already pushed down
+		uint32_t l = tail == nullptr ? 0 : (uint32_t)strlen(tail);
+		put(f, l);
+		if (l > 0) fwrite(tail, 1, l, f);
+	}
+	bool ok = ferror(f) == 0;
+	fclose(f);
+	if (!ok) throw std::runtime_error("cannot write " + path);
+}
+
+std::shared_ptr<SimpleTrie> SimpleTrie::load(const string &path) {
+	FILE *f = fopen(path.c_str(), "rb");
+	if (f == nullptr) throw std::runtime_error("cannot open " + path);
+	std::unique_ptr<FILE, int (*)(FILE *)> guard(f, fclose);
+
+	char magic[sizeof(counts_magic)];
+	if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, counts_magic, sizeof(magic)) != 0)
+		throw std::runtime_error(path + " is not a counts file");
+	int32_t gs;
+	uint64_t rt, st, n;
+	get(f, gs);
+	get(f, rt);
+	get(f, st);
+	get(f, n);
+
+	std::shared_ptr<SimpleTrie> trie(new SimpleTrie(gs));
+	trie->tree.clear();
+	trie->tree.reserve((size_t)n);
+	trie->root = (size_t)rt;
+	trie->start_ch = (size_t)st;
+	for (uint64_t i = 0; i < n; i++) {
+		uint64_t cnt, cnt_end;
+		get(f, cnt);
+		get(f, cnt_end);
+		unsigned char bits[CHAR_NUM / 8];
+		if (fread(bits, 1, sizeof(bits), f) != sizeof(bits)) throw std::runtime_error("truncated counts file");
+		uint32_t num_ch;
+		get(f, num_ch);
+
+		trie->tree.emplace_back((ull)cnt, nullptr, (int)num_ch);
+		SimpleNode &nd = trie->tree.back();
+		nd.cnt_end = (ull)cnt_end;
+		for (int j = 0; j < CHAR_NUM; j++) if (bits[j / 8] >> (j % 8) & 1) nd.v.set(j);
+		for (uint32_t j = 0; j < num_ch; j++) {
+			uint64_t kid;
+			get(f, kid);
+			nd.ch.push_back((size_t)kid);
+		}
+
+		uint32_t l;
+		get(f, l);
+		if (l > 0) {
+			nd.s = new char[l + 1];
+			if (fread(nd.s, 1, l, f) != l) throw std::runtime_error("truncated counts file");
+			nd.s[l] = '\0';
+		}
+	}
+	return trie;
+}
+
+bool SimpleTrie::is_saved(const string &path) {
+	FILE *f = fopen(path.c_str(), "rb");
+	if (f == nullptr) return false;
+	char magic[sizeof(counts_magic)];
+	bool ok = fread(magic, 1, sizeof(magic), f) == sizeof(magic) && memcmp(magic, counts_magic, sizeof(magic)) == 0;
+	fclose(f);
+	return ok;
+}
@@ -9,12 +9,15 @@
 #include <cstring>
 
 #include <vector>
+#include <string>
 #include <bitset>
 #include <algorithm>
 #include <mutex>
+#include <memory>
 
 #include "common.hpp"
 #include "baseNode.hpp"
+#include "modelStats.hpp"
 
 namespace smoothPwd
 {
@@ -26,6 +29,11 @@ namespace smoothPwd
 		}
 	};
 
+	enum CountMethod {
+		COUNT_TRIE,  // insert every suffix of every password into the trie (add_sub)
+		COUNT_SORTED // sort all suffixes of the corpus and read the trie off the sorted order (add_corpus)
+	};
+
 	class SimpleTrie {
 	private:
 		void add_pfx(const char *s, ull cnt = 1, size_t idx = 0); // add prefixes of s to trie
@@ -57,5 +65,22 @@ namespace smoothPwd
 				add_pfx(s + i, cnt, root);
 			}
 		}
+
+		// count a whole corpus of (password, count) at once into an empty trie. the suffixes of the
+		// concatenated corpus, cut to gram size, are sorted bucket by bucket (one bucket per first char)
+		// and each bucket's subtree is emitted in order from the sorted run and the common prefixes
+		// of neighbours. counts are the same as add_sub on every item; faster, and never more memory
+		// than the biggest bucket on top of the trie. the passwords are only read during the call
+		void add_corpus(const std::vector<std::pair<const char *, ull> > &corpus);
+
+		// the counts are a reusable artifact: any model of gram size <= gram_size (Katz with any K)
+		// can be trained from them without going back to the corpus; see BaseTrieModel::train(counts)
+		void save(const std::string &path) const;
+
+		static std::shared_ptr<SimpleTrie> load(const std::string &path);
+
+		static bool is_saved(const std::string &path); // whether path starts like saved counts (else: a wordlist, say)
+
+		TrieStats stats() const; // sizes and memory use
 	};
 } // namespace smoothPwd
@@ -0,0 +1,147 @@
+/*
+ * trace.cpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#include "trace.hpp"
+
+#include <cstdio>
+#include <algorithm>
+#include <map>
+#include <thread>
+#include <functional>
+
+using smoothPwd::Tracer;
+using smoothPwd::TraceSpan;
+using std::string;
+using std::vector;
+
+namespace
+{
+	struct ThreadTrace { // the spans open on this thread, innermost last
+		vector<string> stack;
+		unsigned int tid;
+
+		ThreadTrace() : tid((unsigned int)(std::hash<std::thread::id>()(std::this_thread::get_id()) % 100000)) {}
+	};
+
+	ThreadTrace &thread_trace() {
+		static thread_local ThreadTrace tt;
+		return tt;
+	}
+
+	string json_escape(const string &s) {
+		string res;
+		for (char c : s) {
+			if (c == '"' || c == '\\') res.push_back('\\');
+			res.push_back(c);
+		}
+		return res;
+	}
+}
+
+Tracer &Tracer::global() {
+	static Tracer tracer;
+	return tracer;
+}
+
+void Tracer::enable(bool _on) {
+	std::lock_guard<std::mutex> lock(mut);
+	if (_on && !on.load()) epoch = std::chrono::steady_clock::now();
+	on = _on;
+}
+
+void Tracer::clear() {
+	std::lock_guard<std::mutex> lock(mut);
+	spans.clear();
+}
+
+void Tracer::record(Span &&span) {
+	std::lock_guard<std::mutex> lock(mut);
+	spans.push_back(std::move(span));
+}
+
+bool Tracer::write_chrome(const string &path) const {
+	FILE *f = fopen(path.c_str(), "w");
+	if (f == nullptr) return false;
+	std::lock_guard<std::mutex> lock(mut);
+	fputs("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n", f);
+	for (size_t i = 0; i < spans.size(); i++) {
+		const Span &sp = spans[i];
+		fprintf(f, "{\"name\": \"%s\", \"cat\": \"smoothpwd\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %u, \"args\": {",
+			json_escape(sp.name).c_str(), sp.ts, sp.dur, sp.tid);
+		for (size_t j = 0; j < sp.args.size(); j++) {
+			fprintf(f, "%s\"%s\": %lld", j > 0 ? ", " : "", json_escape(sp.args[j].first).c_str(), sp.args[j].second);
+		}
+		fprintf(f, "}}%s\n", i + 1 < spans.size() ? "," : "");
+	}
+	fputs("]}\n", f);
+	return fclose(f) == 0;
+}
+
+void Tracer::summary(std::ostream &out) const {
+	struct Total {
+		double ts, dur;
+		size_t cnt;
+		int depth;
+		string name;
+		vector<std::pair<string, long long> > args;
+	};
+	std::map<string, Total> totals;
+	{
+		std::lock_guard<std::mutex> lock(mut);
+		for (const auto &sp : spans) {
+			auto it = totals.find(sp.path);
+			if (it == totals.end()) {
+				it = totals.emplace(sp.path, Total{ sp.ts, 0.0, 0, sp.depth, sp.name, {} }).first;
+			}
+			Total &t = it->second;
+			t.ts = std::min(t.ts, sp.ts);
+			t.dur += sp.dur;
+			t.cnt++;
+			for (const auto &a : sp.args) {
+				size_t k = 0;
+				while (k < t.args.size() && t.args[k].first != a.first) ++k;
+				if (k == t.args.size()) t.args.push_back(a);
+				else t.args[k].second += a.second;
+			}
+		}
+	}
+
+	// parents start before their kids, so start time order is a pre-order walk
+	vector<const Total *> order;
+	for (const auto &item : totals) order.push_back(&item.second);
+	std::stable_sort(order.begin(), order.end(), [](const Total *a, const Total *b) {
+		return a->ts < b->ts || (a->ts == b->ts && a->depth < b->depth);
+	});
+	for (const Total *t : order) {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%10.3f ms", t->dur / 1000);
+		out << buf << "  " << string(2 * t->depth, ' ') << t->name;
+		if (t->cnt > 1) out << " (x" << t->cnt << ")";
+		for (const auto &a : t->args) out << ' ' << a.first << '=' << a.second;
+		out << '\n';
+	}
+}
+
+TraceSpan::TraceSpan(const char *name) {
+	Tracer &tracer = Tracer::global();
+	if (!tracer.enabled()) return;
+	ThreadTrace &tt = thread_trace();
+	span.reset(new Tracer::Span());
+	span->name = name;
+	span->path = tt.stack.empty() ? span->name : tt.stack.back() + "/" + span->name;
+	span->depth = (int)tt.stack.size();
+	span->tid = tt.tid;
+	tt.stack.push_back(span->path);
+	span->ts = tracer.now();
+	span->dur = 0.0;
+}
+
+TraceSpan::~TraceSpan() {
+	if (!span) return;
+	Tracer &tracer = Tracer::global();
+	span->dur = tracer.now() - span->ts;
+	thread_trace().stack.pop_back();
+	tracer.record(std::move(*span));
+}
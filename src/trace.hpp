@@ -0,0 +1,78 @@
+/*
+ * trace.hpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace smoothPwd
+{
+	class Tracer {
+		// collects scoped spans (see TraceSpan) from all threads; off by default, and then a span
+		// costs one branch. output: Chrome trace JSON (chrome://tracing, Perfetto) and a text summary
+	public:
+		struct Span {
+			std::string name;
+			std::string path; // names of the enclosing spans and this one, '/'-separated
+			double ts, dur;   // microseconds since the tracer was enabled
+			unsigned int tid;
+			int depth;
+			std::vector<std::pair<std::string, long long> > args;
+		};
+
+		static Tracer &global();
+
+		void enable(bool on = true);
+
+		bool enabled() const { return on.load(std::memory_order_relaxed); }
+
+		void clear();
+
+		void record(Span &&span);
+
+		double now() const { // microseconds
+			return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - epoch).count();
+		}
+
+		bool write_chrome(const std::string &path) const;
+
+		// spans with the same path added up, in order of first appearance, indented by depth
+		void summary(std::ostream &out) const;
+
+	private:
+		std::atomic<bool> on;
+		std::chrono::steady_clock::time_point epoch;
+		mutable std::mutex mut;
+		std::vector<Span> spans;
+
+		Tracer() : on(false), epoch(std::chrono::steady_clock::now()) {}
+	};
+
+	class TraceSpan { // RAII: one span of the global tracer, from construction to destruction
+	private:
+		std::unique_ptr<Tracer::Span> span; // null while tracing is off
+
+	public:
+		explicit TraceSpan(const char *name);
+
+		~TraceSpan();
+
+		TraceSpan(const TraceSpan &) = delete;
+
+		TraceSpan &operator=(const TraceSpan &) = delete;
+
+		// a counter shown with the span (items, nodes, ...)
+		void arg(const char *key, long long val) {
+			if (span) span->args.emplace_back(key, val);
+		}
+	};
+} // namespace smoothPwd
@@ -0,0 +1,183 @@
+/*
+ * modelTests.cpp
+ * Copyright (c) 2021 Yuanming Song
+ */
+
+// behaviour the generation modes promise each other: shards split the guess list, a resumed job writes
+// what an uninterrupted one does, exclusion leaves the filter's guesses out (and nothing else), and
+// sampling does not depend on the threads. run by ctest; the model is trained on a synthetic corpus
+
+#include <cstdio>
+#include <iostream>
+#include <algorithm>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "kneserNey.hpp"
+#include "checkpoint.hpp"
+#include "externalSort.hpp"
+#include "guessFilter.hpp"
+
+using namespace smoothPwd;
+using std::cout;
+using std::endl;
+using std::set;
+using std::string;
+using std::vector;
+
+namespace
+{
+	int failures = 0;
+
+	void check(bool ok, const string &what) {
+		cout << (ok ? "ok   " : "FAIL ") << what << endl;
+		if (!ok) failures++;
+	}
+
+	vector<string> corpus() { // words, some with digits appended: enough shape for a few 10k guesses
+		const char *stems[] = { "love", "pass", "dragon", "monkey", "sun", "star", "qwerty", "abc", "shadow", "master" };
+		std::mt19937 re(7);
+		vector<string> data;
+		for (int i = 0; i < 20000; i++) {
+			string s = stems[re() % 10];
+			if (re() % 2) s += stems[re() % 10];
+			for (unsigned d = re() % 4; d > 0; d--) s += (char)('0' + re() % 10);
+			data.push_back(s);
+		}
+		return data;
+	}
+
+	vector<StrProb> search(const BaseTrieModel &model, double thres, size_t shard = 0, size_t num_shards = 1) {
+		vector<StrProb> guesses;
+		model.threshold_search_shard([&guesses](const string &s, double p) { guesses.emplace_back(s, p); }, shard, num_shards, thres);
+		return guesses;
+	}
+
+	set<string> strings(const vector<StrProb> &guesses) {
+		set<string> out;
+		for (const auto &g : guesses) out.insert(g.first);
+		return out;
+	}
+
+	void test_shards(const BaseTrieModel &model, double thres) {
+		set<string> all = strings(search(model, thres));
+		const size_t num_shards = 3, num_parts = 4;
+		set<string> uni;
+		size_t total = 0;
+		bool same_split = true;
+		for (size_t shard = 0; shard < num_shards; shard++) {
+			set<string> mine = strings(search(model, thres, shard, num_shards));
+			total += mine.size();
+			uni.insert(mine.begin(), mine.end());
+
+			// the per-thread split of stream mode covers exactly the shard
+			set<string> parts;
+			for (const auto &frames : model.split_shard(shard, num_shards, num_parts, thres)) {
+				model.search_frames([&parts](const string &s, double) { parts.insert(s); }, frames, thres);
+			}
+			same_split = same_split && parts == mine;
+		}
+		check(total == uni.size(), "shards are disjoint");
+		check(uni == all, "the union of the shards is the full search");
+		check(same_split, "split_shard covers exactly its shard");
+	}
+
+	void test_resume(const BaseTrieModel &model, double thres) {
+		// a job killed after two bands and resumed from its checkpoint writes what an uninterrupted one does
+		const size_t band_size = 2000;
+		vector<StrProb> whole;
+		double factor = 0;
+		model.generate_bands([&whole](const vector<StrProb> &band, double) { whole.insert(whole.end(), band.begin(), band.end()); },
+			thres, 1.0, factor, band_size);
+
+		const string path = "modelTests.ckpt";
+		vector<StrProb> resumed;
+		GenerationCheckpoint job;
+		job.thres = thres;
+		int bands = 0;
+		try {
+			factor = 0;
+			model.generate_bands([&](const vector<StrProb> &band, double lo) {
+				if (bands++ == 2) throw std::runtime_error("killed");
+				resumed.insert(resumed.end(), band.begin(), band.end());
+				job.hi = lo;
+				job.factor = factor;
+				job.emitted = resumed.size();
+				job.save(path);
+			}, thres, 1.0, factor, band_size);
+		}
+		catch (const std::runtime_error &) {}
+		GenerationCheckpoint saved;
+		bool loaded = GenerationCheckpoint::load(path, saved);
+		check(loaded && saved.same_job(job) && saved.emitted == resumed.size(), "checkpoint saves and loads");
+		factor = saved.factor;
+		model.generate_bands([&resumed](const vector<StrProb> &band, double) { resumed.insert(resumed.end(), band.begin(), band.end()); },
+			thres, saved.hi, factor, band_size);
+		remove(path.c_str());
+
+		check(bands == 3, "the job was stopped mid-way");
+		check(resumed == whole, "a resumed job writes the same guesses, in the same order");
+	}
+
+	void test_exclusion(const BaseTrieModel &model) {
+		const ull cnt = 5000;
+		vector<StrProb> top = model.generate(2 * cnt, true);
+		GuessFilter filter(cnt);
+		for (size_t i = 0; i < top.size(); i += 2) filter.add(top[i].first); // every other top guess was tried already
+
+		vector<StrProb> kept = model.generate_excluding(filter, cnt);
+		bool none_held = true;
+		for (const auto &g : kept) none_held = none_held && !filter.contains(g.first);
+		check(none_held, "excluded guesses are left out");
+		check(kept.size() >= cnt, "exclusion still yields guess_num guesses");
+
+		// everything above the final threshold that the filter does not hold is kept
+		double thres = model.exclusion_threshold(filter, cnt);
+		set<string> expect;
+		model.threshold_search([&](const string &s, double) { if (!filter.contains(s)) expect.insert(s); }, thres);
+		check(strings(kept) == expect, "only the filter's guesses are left out");
+	}
+
+	void test_sampling(const BaseTrieModel &model) {
+		check(model.sample_many(5000, 42, 1) == model.sample_many(5000, 42, 3), "samples do not depend on the threads");
+	}
+
+	void test_truncated_run() {
+		const string path = "modelTests.run";
+		FILE *f = fopen(path.c_str(), "wb");
+		double p = 0.5;
+		uint16_t len = 5;
+		fwrite(&p, sizeof(p), 1, f);
+		fwrite(&len, sizeof(len), 1, f);
+		fwrite("abc", 1, 3, f); // 2 chars short
+		fclose(f);
+		bool thrown = false;
+		try {
+			GuessRunReader run(path, 4096);
+			while (run.next()) {}
+		}
+		catch (const std::runtime_error &) {
+			thrown = true;
+		}
+		remove(path.c_str());
+		check(thrown, "a run cut mid-record throws");
+	}
+}
+
+int main() {
+	ModifiedKneserNeyModel model(4);
+	model.train(corpus());
+	double thres = model.generate_threshold(30000);
+
+	test_shards(model, thres);
+	test_resume(model, thres);
+	test_exclusion(model);
+	test_sampling(model);
+	test_truncated_run();
+
+	cout << (failures == 0 ? "all passed" : std::to_string(failures) + " failed") << endl;
+	return failures == 0 ? 0 : 1;
+}